@@ -1,45 +1,325 @@
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "../psram/psram.h"
 #include "cache.h"
 
-#define ADDR_BITS 24
-
 #include "vm_config.h"
 
+// Address bits needed to cover guest RAM
+#if EMULATOR_RAM_MB <= 16
+#define ADDR_BITS 24
+#elif EMULATOR_RAM_MB <= 32
+#define ADDR_BITS 25
+#elif EMULATOR_RAM_MB <= 64
+#define ADDR_BITS 26
+#elif EMULATOR_RAM_MB <= 128
+#define ADDR_BITS 27
+#else
+#define ADDR_BITS 28
+#endif
+
+#ifndef CACHE_WAYS
+#define CACHE_WAYS 2
+#endif
+
+#if CACHE_WAYS == 1
+#define WAY_BITS 0
+#elif CACHE_WAYS == 2
+#define WAY_BITS 1
+#elif CACHE_WAYS == 4
+#define WAY_BITS 2
+#elif CACHE_WAYS == 8
+#define WAY_BITS 3
+#else
+#error CACHE_WAYS must be 1, 2, 4 or 8
+#endif
+
+// Instruction cache. Set ICACHE_SET_SIZE to 0 to fetch through the data cache.
+#ifndef ICACHE_SET_SIZE
+#define ICACHE_LINE_SIZE 32
+#define ICACHE_OFFSET_BITS 5 // log2(ICACHE_LINE_SIZE)
+#define ICACHE_SET_SIZE 256
+#define ICACHE_INDEX_BITS 8 // log2(ICACHE_SET_SIZE)
+#endif
+
+#ifndef ICACHE_WAYS
+#define ICACHE_WAYS 2
+#endif
+
+#if ICACHE_WAYS == 1
+#define IWAY_BITS 0
+#elif ICACHE_WAYS == 2
+#define IWAY_BITS 1
+#elif ICACHE_WAYS == 4
+#define IWAY_BITS 2
+#elif ICACHE_WAYS == 8
+#define IWAY_BITS 3
+#else
+#error ICACHE_WAYS must be 1, 2, 4 or 8
+#endif
+
+// Number of following lines read in the same PSRAM burst once two misses in
+// a row hit consecutive lines. 0 disables prefetching.
+#ifndef CACHE_PREFETCH_LINES
+#define CACHE_PREFETCH_LINES 4
+#endif
+
+#if CACHE_PREFETCH_LINES >= CACHE_SET_SIZE || (ICACHE_SET_SIZE && CACHE_PREFETCH_LINES >= ICACHE_SET_SIZE)
+#error CACHE_PREFETCH_LINES must be less than CACHE_SET_SIZE and ICACHE_SET_SIZE
+#endif
+
+#define RAM_BYTES ((uint32_t)EMULATOR_RAM_MB * 1024 * 1024)
+
+// Fully associative buffer holding the lines most recently evicted from the
+// data cache, so conflict misses between a few hot lines don't go to PSRAM.
+// 0 disables it.
+#ifndef CACHE_VICTIM_LINES
+#define CACHE_VICTIM_LINES 8
+#endif
+
+#ifndef CACHE_STATS
+#define CACHE_STATS 0
+#endif
+
+#if CACHE_LINE_SIZE > 128
+#error CACHE_LINE_SIZE must be at most 128
+#endif
+
+// Data cache lines track which 32-bit words they hold, so a store that
+// misses can take a line without reading it from PSRAM first.
+#define LINE_WORDS (CACHE_LINE_SIZE / 4)
+#define FULL_MASK ((uint32_t)(((uint64_t)1 << LINE_WORDS) - 1))
+#define WORD_MASK(offset, size) ((uint32_t)(((uint64_t)2 << (((offset) + (size)-1) >> 2)) - ((uint64_t)1 << ((offset) >> 2))))
+
 #define OFFSET(addr) (addr & (CACHE_LINE_SIZE - 1))
 #define INDEX(addr) ((addr >> OFFSET_BITS) & (CACHE_SET_SIZE - 1))
 #define TAG(addr) (addr >> (OFFSET_BITS + INDEX_BITS))
 #define BASE(addr) (addr & (~(uint32_t)(CACHE_LINE_SIZE - 1)))
 
+#define IOFFSET(addr) (addr & (ICACHE_LINE_SIZE - 1))
+#define IINDEX(addr) ((addr >> ICACHE_OFFSET_BITS) & (ICACHE_SET_SIZE - 1))
+#define ITAG(addr) (addr >> (ICACHE_OFFSET_BITS + ICACHE_INDEX_BITS))
+#define IBASE(addr) (addr & (~(uint32_t)(ICACHE_LINE_SIZE - 1)))
+
 #define LINE_TAG(line) (line->tag)
 
+// Tags stay 16 bits unless RAM is too large for the cache geometry.
+#if ADDR_BITS - OFFSET_BITS - INDEX_BITS > 16
+typedef uint32_t cache_tag_t;
+#else
+typedef uint16_t cache_tag_t;
+#endif
+
+#if ICACHE_SET_SIZE && ADDR_BITS - ICACHE_OFFSET_BITS - ICACHE_INDEX_BITS > 16
+typedef uint32_t icache_tag_t;
+#else
+typedef uint16_t icache_tag_t;
+#endif
+
 #define IS_VALID(line) (line->status & 0b01)
 #define IS_DIRTY(line) (line->status & 0b10)
-#define IS_LRU(line) (line->status & 0b100)
+#define IS_PREFETCHED(line) (line->status & 0b100) // read ahead and not used yet
 
 #define SET_VALID(line) line->status = 1
 #define SET_DIRTY(line) line->status |= 0b10;
-#define SET_LRU(line) line->status |= 0b100;
-#define CLEAR_LRU(line) line->status &= ~0b100;
+#define CLEAR_DIRTY(line) line->status &= ~0b10
+#define SET_PREFETCHED(line) line->status = 0b101
+#define CLEAR_PREFETCHED(line) line->status &= ~0b100
+
+#if CACHE_STATS
+static uint64_t stats[CACHE_STAT_SET_CONFLICTS];
+static uint32_t set_conflicts[CACHE_SET_SIZE];
+#define STAT_ADD(n, val) stats[n] += (val)
+#else
+#define STAT_ADD(n, val) do { } while (0)
+#endif
+#define STAT(n) STAT_ADD(n, 1)
+
+#ifndef PSRAM_ASYNC
+#define PSRAM_ASYNC 0
+#endif
+
+#if PSRAM_ASYNC
+// A dirty line evicted on a miss is copied here and only posted once the
+// refill is done, so the write-back runs while the guest carries on. Any
+// other access to its range posts it first, which keeps PSRAM in order.
+static uint8_t wb_buf[CACHE_LINE_SIZE];
+static uint32_t wb_addr;
+static bool wb_queued;
+
+static void writeback_post(void)
+{
+    if (wb_queued)
+    {
+        wb_queued = false;
+        psram_write_posted(wb_addr, CACHE_LINE_SIZE, wb_buf);
+    }
+}
 
-#define psram_write(ofs, p, sz) psram_access(ofs, sz, true, p)
-#define psram_read(ofs, p, sz) psram_access(ofs, sz, false, p)
+#define WRITEBACK_CHECK(ofs, sz)                                                   \
+    if (wb_queued && (ofs) < wb_addr + CACHE_LINE_SIZE && wb_addr < (ofs) + (sz))  \
+        writeback_post();
+#else
+#define WRITEBACK_CHECK(ofs, sz)
+#define writeback_post()
+#endif
+
+#define psram_write(ofs, p, sz)                    \
+    do                                             \
+    {                                              \
+        STAT_ADD(CACHE_STAT_PSRAM_WRITE, sz);      \
+        WRITEBACK_CHECK(ofs, sz);                  \
+        psram_access(ofs, sz, true, p);            \
+    } while (0)
+#define psram_read(ofs, p, sz)                     \
+    do                                             \
+    {                                              \
+        STAT_ADD(CACHE_STAT_PSRAM_READ, sz);       \
+        WRITEBACK_CHECK(ofs, sz);                  \
+        psram_access(ofs, sz, false, p);           \
+    } while (0)
 
 struct Cacheline
 {
-    uint16_t tag;
+    cache_tag_t tag;
     uint8_t data[CACHE_LINE_SIZE];
     uint8_t status;
+    uint32_t present; // words of data that are valid, FULL_MASK once filled
 };
 typedef struct Cacheline cacheline_t;
 
-cacheline_t cache[CACHE_SET_SIZE][2];
+#if ICACHE_SET_SIZE
+// Instruction cache lines are never written by the guest, so they carry no
+// dirty state.
+struct ICacheline
+{
+    icache_tag_t tag;
+    uint8_t valid; // 2 if prefetched and not used yet
+    uint8_t data[ICACHE_LINE_SIZE];
+};
+typedef struct ICacheline icacheline_t;
+#endif
+
+cacheline_t cache[CACHE_SET_SIZE][CACHE_WAYS];
+
+// One bit per set that may hold dirty lines, so cache_flush can skip clean
+// sets. Set on every store, cleared by cache_flush.
+static uint32_t dirty_sets[(CACHE_SET_SIZE + 31) / 32];
+#define MARK_DIRTY_SET(index) dirty_sets[(index) >> 5] |= 1u << ((index)&31)
+
+// Longest run of adjacent dirty lines cache_flush writes in one burst.
+#define FLUSH_BURST_LINES 8
+
+// Tree pseudo-LRU, one byte per set. Bit n (1..ways-1) is a node of a
+// binary tree over the ways, numbered like a heap, and points to the half
+// that was used less recently.
+static uint8_t plru[CACHE_SET_SIZE];
+
+#if ICACHE_SET_SIZE
+static icacheline_t icache[ICACHE_SET_SIZE][ICACHE_WAYS];
+static uint8_t iplru[ICACHE_SET_SIZE];
+#endif
+uint32_t icache_generation;
+
+#if CACHE_VICTIM_LINES
+struct VictimLine
+{
+    cacheline_t line;
+    uint16_t index; // set the line was evicted from
+};
+
+static struct VictimLine victims[CACHE_VICTIM_LINES];
+static int victim_next; // replaced next, round robin
+#endif
+
+uint32_t cache_prefetch_useful, cache_prefetch_wasted;
+
+#if CACHE_PREFETCH_LINES
+// Misses on consecutive lines are taken to be a sequential stream (code,
+// memcpy, block copies) and the lines after the missing one are read along
+// with it.
+struct Stream
+{
+    uint32_t next; // line a continuing stream misses on next
+};
+
+static struct Stream dstream;
+#if ICACHE_SET_SIZE
+static struct Stream istream;
+#endif
+
+#if ICACHE_SET_SIZE && ICACHE_LINE_SIZE > CACHE_LINE_SIZE
+static uint8_t prefetch_buf[(CACHE_PREFETCH_LINES + 1) * ICACHE_LINE_SIZE];
+#else
+static uint8_t prefetch_buf[(CACHE_PREFETCH_LINES + 1) * CACHE_LINE_SIZE];
+#endif
+
+// Called on a miss on the line at base, returns how many lines after it to
+// read ahead.
+static int stream_miss(struct Stream *stream, uint32_t base, uint32_t line_size)
+{
+    uint32_t ahead = 0;
+
+    if (base == stream->next)
+    {
+        ahead = CACHE_PREFETCH_LINES;
+        if (ahead > (RAM_BYTES - base) / line_size - 1)
+            ahead = (RAM_BYTES - base) / line_size - 1;
+    }
+    stream->next = base + line_size;
+    return ahead;
+}
+#endif
 
 void cache_reset(void)
 {
     memset(cache, 0, sizeof(cache));
+    memset(plru, 0, sizeof(plru));
+    memset(dirty_sets, 0, sizeof(dirty_sets));
+#if CACHE_VICTIM_LINES
+    memset(victims, 0, sizeof(victims));
+#endif
+#if CACHE_PREFETCH_LINES
+    memset(&dstream, 0xff, sizeof(dstream));
+#if ICACHE_SET_SIZE
+    memset(&istream, 0xff, sizeof(istream));
+#endif
+#endif
+#if ICACHE_SET_SIZE
+    memset(icache, 0, sizeof(icache));
+    memset(iplru, 0, sizeof(iplru));
+#endif
+    icache_generation++;
+#if PSRAM_ASYNC
+    wb_queued = false;
+    psram_wait();
+#endif
+}
+
+static inline void plru_touch(uint8_t *plru_bits, int way_bits, int way)
+{
+    uint8_t bits = *plru_bits;
+    int node = 1;
+    for (int level = way_bits - 1; level >= 0; level--)
+    {
+        int dir = (way >> level) & 1;
+        if (dir)
+            bits &= ~(1 << node);
+        else
+            bits |= 1 << node;
+        node = node * 2 + dir;
+    }
+    *plru_bits = bits;
+}
+
+static inline int plru_victim(uint8_t bits, int way_bits)
+{
+    int node = 1;
+    for (int level = 0; level < way_bits; level++)
+        node = node * 2 + ((bits >> node) & 1);
+    return node - (1 << way_bits);
 }
 
 static inline void flush_line(cacheline_t *line, uint16_t index)
@@ -49,152 +329,687 @@ static inline void flush_line(cacheline_t *line, uint16_t index)
         // flush line to RAM
         uint32_t flush_base =
             (index << OFFSET_BITS) | ((uint32_t)(LINE_TAG(line)) << (INDEX_BITS + OFFSET_BITS));
-        psram_write(flush_base, line->data, CACHE_LINE_SIZE);
+        if (line->present == FULL_MASK)
+        {
+            psram_write(flush_base, line->data, CACHE_LINE_SIZE);
+            return;
+        }
+
+        // only write back the runs of words that were stored
+        for (int word = 0; word < LINE_WORDS;)
+        {
+            if (!(line->present & (1u << word)))
+            {
+                word++;
+                continue;
+            }
+            int end = word;
+            while (end < LINE_WORDS && (line->present & (1u << end)))
+                end++;
+            psram_write(flush_base + word * 4, line->data + word * 4, (end - word) * 4);
+            word = end;
+        }
     }
 }
 
-void cache_flush(void)
+// Read the words of a partially written line that are still missing.
+static void fill_line(cacheline_t *line, uint32_t addr)
 {
-    for (int index = 0; index < CACHE_SET_SIZE; index++)
+    uint8_t buf[CACHE_LINE_SIZE];
+    psram_read(BASE(addr), buf, CACHE_LINE_SIZE);
+    for (int word = 0; word < LINE_WORDS; word++)
+        if (!(line->present & (1u << word)))
+            memcpy(line->data + word * 4, buf + word * 4, 4);
+    line->present = FULL_MASK;
+}
+
+static inline void evict_line(cacheline_t *line, uint16_t index)
+{
+    if (IS_PREFETCHED(line))
+        cache_prefetch_wasted++;
+    if (IS_DIRTY(line))
+        STAT(CACHE_STAT_DIRTY_EVICTIONS);
+#if PSRAM_ASYNC
+    if (IS_DIRTY(line) && line->present == FULL_MASK)
     {
-        flush_line(&cache[index][0], index);
-        flush_line(&cache[index][1], index);
+        STAT_ADD(CACHE_STAT_PSRAM_WRITE, CACHE_LINE_SIZE);
+        writeback_post();
+        psram_wait(); // wb_buf may still be going out
+        memcpy(wb_buf, line->data, CACHE_LINE_SIZE);
+        wb_addr = (index << OFFSET_BITS) | ((uint32_t)(LINE_TAG(line)) << (INDEX_BITS + OFFSET_BITS));
+        wb_queued = true;
+        return;
     }
+#endif
+    flush_line(line, index);
 }
 
-void cache_read(uint32_t addr, void *ptr, uint8_t size)
+#if CACHE_VICTIM_LINES
+static cacheline_t *victim_find(uint16_t index, cache_tag_t tag)
 {
-    uint16_t index = INDEX(addr);
-    uint16_t tag = TAG(addr);
-    uint8_t offset = OFFSET(addr);
+    for (int i = 0; i < CACHE_VICTIM_LINES; i++)
+        if (IS_VALID((&victims[i].line)) && victims[i].index == index && LINE_TAG((&victims[i].line)) == tag)
+            return &victims[i].line;
+    return NULL;
+}
 
-    cacheline_t *line;
-    cacheline_t *way1 = &cache[index][0];
-    cacheline_t *way2 = &cache[index][1];
+// Called on a miss with the way about to be replaced. If the missing line is
+// in the victim buffer, it is swapped with that way and 1 is returned.
+// Otherwise the way's line moves to the buffer, pushing out (and writing
+// back) the oldest entry, and the way is left for the caller to fill.
+static int victim_swap(cacheline_t *line, uint16_t index, cache_tag_t tag)
+{
+    cacheline_t *found = victim_find(index, tag);
+    if (found)
+    {
+        cacheline_t evicted = *line;
+        *line = *found;
+        *found = evicted; // same set, so the index stays
+        if (IS_DIRTY(line))
+            MARK_DIRTY_SET(index);
+        return 1;
+    }
 
-    if (tag == LINE_TAG(way1) && IS_VALID(way1))
+    if (IS_VALID(line))
     {
-        line = way1;
-        CLEAR_LRU(way1);
-        SET_LRU(way2);
+        struct VictimLine *slot = &victims[victim_next];
+        victim_next = (victim_next + 1) % CACHE_VICTIM_LINES;
+        if (IS_VALID((&slot->line)))
+            evict_line(&slot->line, slot->index);
+        slot->line = *line;
+        slot->index = index;
     }
-    else if (tag == LINE_TAG(way2) && IS_VALID(way2))
+    return 0;
+}
+#endif
+
+// The dirty line with the given line number (address >> OFFSET_BITS), in
+// the cache or the victim buffer.
+static cacheline_t *dirty_line(uint32_t number)
+{
+    uint16_t index = number & (CACHE_SET_SIZE - 1);
+    cache_tag_t tag = number >> INDEX_BITS;
+
+    for (int way = 0; way < CACHE_WAYS; way++)
+    {
+        cacheline_t *line = &cache[index][way];
+        if (IS_DIRTY(line) && LINE_TAG(line) == tag)
+            return line;
+    }
+#if CACHE_VICTIM_LINES
+    for (int i = 0; i < CACHE_VICTIM_LINES; i++)
     {
-        line = way2;
-        CLEAR_LRU(way2);
-        SET_LRU(way1);
+        cacheline_t *line = &victims[i].line;
+        if (IS_DIRTY(line) && victims[i].index == index && LINE_TAG(line) == tag)
+            return line;
     }
+#endif
+    return NULL;
+}
+
+static int line_number_cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Write back every dirty line, leaving it cached and clean. The dirty lines
+// (found through dirty_sets, plus the victim buffer) are sorted by address
+// and written out in one walk, runs of adjacent whole lines in a single
+// burst.
+void cache_flush(void)
+{
+    static uint8_t burst[FLUSH_BURST_LINES * CACHE_LINE_SIZE];
+    // line numbers of the dirty lines, 4 bytes per line the cache can hold
+    static uint32_t order[CACHE_SET_SIZE * CACHE_WAYS + CACHE_VICTIM_LINES];
+    uint32_t n = 0;
+
+    writeback_post();
 
-    else // miss
+    for (int word = 0; word < (CACHE_SET_SIZE + 31) / 32; word++)
     {
-        if (IS_LRU(way1))
+        for (uint32_t bits = dirty_sets[word]; bits; bits &= bits - 1)
         {
-            line = way1;
-            CLEAR_LRU(way1);
-            SET_LRU(way2);
+            uint16_t index = word * 32 + __builtin_ctz(bits);
+
+            for (int way = 0; way < CACHE_WAYS; way++)
+            {
+                cacheline_t *line = &cache[index][way];
+                if (IS_DIRTY(line))
+                    order[n++] = ((uint32_t)LINE_TAG(line) << INDEX_BITS) | index;
+            }
         }
+    }
+    memset(dirty_sets, 0, sizeof(dirty_sets));
+#if CACHE_VICTIM_LINES
+    for (int i = 0; i < CACHE_VICTIM_LINES; i++)
+        if (IS_DIRTY((&victims[i].line)))
+            order[n++] = ((uint32_t)LINE_TAG((&victims[i].line)) << INDEX_BITS) | victims[i].index;
+#endif
 
-        else
+    qsort(order, n, sizeof(order[0]), line_number_cmp);
+
+    for (uint32_t i = 0; i < n;)
+    {
+        cacheline_t *line = dirty_line(order[i]);
+        uint32_t base = order[i] << OFFSET_BITS;
+
+        if (line->present != FULL_MASK)
         {
-            line = way2;
-            CLEAR_LRU(way2);
-            SET_LRU(way1);
+            flush_line(line, INDEX(base));
+            CLEAR_DIRTY(line);
+            i++;
+            continue;
         }
 
-        if (IS_DIRTY(line)) // if line is valid and dirty, flush it to RAM
+        // gather the following lines while they are whole and dirty too
+        int count = 0;
+        do
         {
-            // flush line to RAM
-            uint32_t flush_base =
-                (index << OFFSET_BITS) | ((uint32_t)(LINE_TAG(line)) << (INDEX_BITS + OFFSET_BITS));
-            psram_write(flush_base, line->data, CACHE_LINE_SIZE);
+            memcpy(burst + count * CACHE_LINE_SIZE, line->data, CACHE_LINE_SIZE);
+            CLEAR_DIRTY(line);
+            count++;
+            i++;
+            line = i < n && order[i] == order[i - 1] + 1 ? dirty_line(order[i]) : NULL;
+        } while (line && line->present == FULL_MASK && count < FLUSH_BURST_LINES);
+        psram_write(base, burst, count * CACHE_LINE_SIZE);
+    }
+    psram_wait();
+}
+
+#if CACHE_PREFETCH_LINES
+// Pick the ways the count lines after base would be read into. Stops at the
+// first line that is already cached or would replace a dirty line, since
+// read-ahead never writes back. Returns how many lines can be prefetched.
+static int cache_prefetch_slots(uint32_t base, int count, cacheline_t **ahead)
+{
+    for (int i = 0; i < count; i++)
+    {
+        uint32_t addr = base + (i + 1) * CACHE_LINE_SIZE;
+        uint16_t index = INDEX(addr);
+        cache_tag_t tag = TAG(addr);
+        cacheline_t *set = cache[index];
+        int victim = -1;
+
+        for (int way = 0; way < CACHE_WAYS; way++)
+        {
+            if (!IS_VALID((&set[way])))
+            {
+                if (victim < 0)
+                    victim = way;
+            }
+            else if (LINE_TAG((&set[way])) == tag)
+                return i;
         }
+#if CACHE_VICTIM_LINES
+        if (victim_find(index, tag))
+            return i;
+#endif
+
+        // prefetched lines don't count as used, so they go first if unused
+        if (victim < 0)
+            victim = plru_victim(plru[index], WAY_BITS);
+        if (IS_DIRTY((&set[victim])))
+            return i;
+        evict_line(&set[victim], index);
+        set[victim].status = 0;
+        ahead[i] = &set[victim];
+    }
+    return count;
+}
+#endif
 
-        // get line from RAM
-        uint32_t base = BASE(addr);
-        psram_read(base, line->data, CACHE_LINE_SIZE);
+// Find the line holding addr, writing back the line it replaces on a miss.
+// With fill set, a missing line is read from PSRAM; otherwise it starts out
+// empty and the caller fills in the words it needs.
+static cacheline_t *cache_lookup(uint32_t addr, int fill)
+{
+    uint16_t index = INDEX(addr);
+    cache_tag_t tag = TAG(addr);
+    cacheline_t *set = cache[index];
+    int victim = -1;
 
-        line->tag = tag; // set the tag of the line
-        SET_VALID(line); // mark the line as valid
+    for (int way = 0; way < CACHE_WAYS; way++)
+    {
+        cacheline_t *line = &set[way];
+        if (!IS_VALID(line))
+        {
+            if (victim < 0)
+                victim = way;
+        }
+        else if (tag == LINE_TAG(line))
+        {
+            if (IS_PREFETCHED(line))
+            {
+                cache_prefetch_useful++;
+                CLEAR_PREFETCHED(line);
+            }
+            plru_touch(&plru[index], WAY_BITS, way);
+            STAT(CACHE_STAT_DHITS);
+            return line;
+        }
     }
 
-    /*
-        if (offset + size > CACHE_LINE_SIZE)
+    // miss: take an empty way if there is one, else the pseudo-LRU one
+    if (victim < 0)
+        victim = plru_victim(plru[index], WAY_BITS);
+    plru_touch(&plru[index], WAY_BITS, victim);
+
+    cacheline_t *line = &set[victim];
+    STAT(CACHE_STAT_DMISSES);
+#if CACHE_STATS
+    if (IS_VALID(line))
+        set_conflicts[index]++;
+#endif
+#if CACHE_VICTIM_LINES
+    if (victim_swap(line, index, tag))
+    {
+        STAT(CACHE_STAT_VICTIM_HITS);
+#if !ICACHE_SET_SIZE
+        icache_generation++;
+#endif
+        return line;
+    }
+#else
+    evict_line(line, index);
+#endif
+
+    // get line from RAM
+    if (fill)
+    {
+        uint32_t base = BASE(addr);
+#if CACHE_PREFETCH_LINES
+        cacheline_t *ahead[CACHE_PREFETCH_LINES];
+        int count = cache_prefetch_slots(base, stream_miss(&dstream, base, CACHE_LINE_SIZE), ahead);
+        if (count)
         {
-            // printf("cross boundary read!\n");
-            size = CACHE_LINE_SIZE - offset;
+            psram_read(base, prefetch_buf, (count + 1) * CACHE_LINE_SIZE);
+            memcpy(line->data, prefetch_buf, CACHE_LINE_SIZE);
+            for (int i = 0; i < count; i++)
+            {
+                memcpy(ahead[i]->data, prefetch_buf + (i + 1) * CACHE_LINE_SIZE, CACHE_LINE_SIZE);
+                ahead[i]->present = FULL_MASK;
+                ahead[i]->tag = TAG((base + (i + 1) * CACHE_LINE_SIZE));
+                SET_PREFETCHED(ahead[i]);
+            }
+            dstream.next = base + (count + 1) * CACHE_LINE_SIZE;
         }
-    */
+        else
+#endif
+            psram_read(base, line->data, CACHE_LINE_SIZE);
+        line->present = FULL_MASK;
+    }
+    else
+        line->present = 0;
+
+    line->tag = tag; // set the tag of the line
+    SET_VALID(line); // mark the line as valid
+#if !ICACHE_SET_SIZE
+    icache_generation++;
+#endif
+    writeback_post();
 
-    while (size--)
-        *(uint8_t *)(ptr++) = line->data[offset++];
-    // for ( int i = 0; i < size; i++ ) ( (uint8_t *)( ptr ) )[i] = line->data[offset + i];
+    return line;
 }
 
-void cache_write(uint32_t addr, void *ptr, uint8_t size)
+// The data cache line holding addr, or NULL. Does not count as a use.
+static cacheline_t *cache_probe(uint32_t addr)
 {
-    uint16_t index = INDEX(addr);
-    uint16_t tag = TAG(addr);
-    uint8_t offset = OFFSET(addr);
+    cacheline_t *set = cache[INDEX(addr)];
+    cache_tag_t tag = TAG(addr);
+
+    for (int way = 0; way < CACHE_WAYS; way++)
+        if (IS_VALID((&set[way])) && LINE_TAG((&set[way])) == tag)
+            return &set[way];
+#if CACHE_VICTIM_LINES
+    return victim_find(INDEX(addr), tag);
+#else
+    return NULL;
+#endif
+}
 
-    cacheline_t *line;
-    cacheline_t *way1 = &cache[index][0];
-    cacheline_t *way2 = &cache[index][1];
+#if ICACHE_SET_SIZE
+static void icache_overlay(icacheline_t *line, uint32_t base);
 
-    if (tag == LINE_TAG(way1) && IS_VALID(way1))
+#if CACHE_PREFETCH_LINES
+// Same as cache_prefetch_slots, without the dirty lines to worry about.
+static int icache_prefetch_slots(uint32_t base, int count, icacheline_t **ahead)
+{
+    for (int i = 0; i < count; i++)
     {
-        line = way1;
-        CLEAR_LRU(way1);
-        SET_LRU(way2);
+        uint32_t addr = base + (i + 1) * ICACHE_LINE_SIZE;
+        uint16_t index = IINDEX(addr);
+        icache_tag_t tag = ITAG(addr);
+        icacheline_t *set = icache[index];
+        int victim = -1;
+
+        for (int way = 0; way < ICACHE_WAYS; way++)
+        {
+            if (!set[way].valid)
+            {
+                if (victim < 0)
+                    victim = way;
+            }
+            else if (set[way].tag == tag)
+                return i;
+        }
+
+        if (victim < 0)
+            victim = plru_victim(iplru[index], IWAY_BITS);
+        if (set[victim].valid == 2)
+            cache_prefetch_wasted++;
+        set[victim].valid = 0;
+        ahead[i] = &set[victim];
     }
-    else if (tag == LINE_TAG(way2) && IS_VALID(way2))
+    return count;
+}
+#endif
+
+static icacheline_t *icache_lookup(uint32_t addr)
+{
+    uint16_t index = IINDEX(addr);
+    icache_tag_t tag = ITAG(addr);
+    icacheline_t *set = icache[index];
+    int victim = -1;
+
+    for (int way = 0; way < ICACHE_WAYS; way++)
     {
-        line = way2;
-        CLEAR_LRU(way2);
-        SET_LRU(way1);
+        icacheline_t *line = &set[way];
+        if (!line->valid)
+        {
+            if (victim < 0)
+                victim = way;
+        }
+        else if (tag == line->tag)
+        {
+            if (line->valid == 2)
+            {
+                cache_prefetch_useful++;
+                line->valid = 1;
+            }
+            plru_touch(&iplru[index], IWAY_BITS, way);
+            STAT(CACHE_STAT_IHITS);
+            return line;
+        }
     }
 
-    else // miss
+    if (victim < 0)
+        victim = plru_victim(iplru[index], IWAY_BITS);
+    plru_touch(&iplru[index], IWAY_BITS, victim);
+    STAT(CACHE_STAT_IMISSES);
+
+    icacheline_t *line = &set[victim];
+    uint32_t base = IBASE(addr);
+    if (line->valid == 2)
+        cache_prefetch_wasted++;
+
+#if CACHE_PREFETCH_LINES
+    icacheline_t *ahead[CACHE_PREFETCH_LINES];
+    int count = icache_prefetch_slots(base, stream_miss(&istream, base, ICACHE_LINE_SIZE), ahead);
+    if (count)
     {
-        if (IS_LRU(way1))
+        psram_read(base, prefetch_buf, (count + 1) * ICACHE_LINE_SIZE);
+        memcpy(line->data, prefetch_buf, ICACHE_LINE_SIZE);
+        for (int i = 0; i < count; i++)
         {
-            line = way1;
-            CLEAR_LRU(way1);
-            SET_LRU(way2);
+            uint32_t next = base + (i + 1) * ICACHE_LINE_SIZE;
+            memcpy(ahead[i]->data, prefetch_buf + (i + 1) * ICACHE_LINE_SIZE, ICACHE_LINE_SIZE);
+            icache_overlay(ahead[i], next);
+            ahead[i]->tag = ITAG(next);
+            ahead[i]->valid = 2;
         }
+        istream.next = base + (count + 1) * ICACHE_LINE_SIZE;
+    }
+    else
+#endif
+        psram_read(base, line->data, ICACHE_LINE_SIZE);
 
-        else
+    icache_overlay(line, base);
+
+    line->tag = tag;
+    line->valid = 1;
+    icache_generation++;
+
+    return line;
+}
+
+// PSRAM may be stale where the data cache holds dirty lines, e.g. code the
+// guest has just written.
+static void icache_overlay(icacheline_t *line, uint32_t base)
+{
+    for (uint32_t ofs = 0; ofs < ICACHE_LINE_SIZE;)
+    {
+        uint32_t len = CACHE_LINE_SIZE - OFFSET((base + ofs));
+        if (len > ICACHE_LINE_SIZE - ofs)
+            len = ICACHE_LINE_SIZE - ofs;
+
+        cacheline_t *dline = cache_probe(base + ofs);
+        if (dline && IS_DIRTY(dline))
         {
-            line = way2;
-            CLEAR_LRU(way2);
-            SET_LRU(way1);
+            uint32_t doffset = OFFSET((base + ofs));
+            for (uint32_t i = 0; i < len; i += 4)
+                if (dline->present & (1u << ((doffset + i) >> 2)))
+                    memcpy(line->data + ofs + i, dline->data + doffset + i, 4);
         }
+        ofs += len;
+    }
+}
+
+static void icache_invalidate(uint32_t addr)
+{
+    icacheline_t *set = icache[IINDEX(addr)];
+    icache_tag_t tag = ITAG(addr);
 
-        if (IS_DIRTY(line)) // if line is valid and dirty, flush it to RAM
+    for (int way = 0; way < ICACHE_WAYS; way++)
+    {
+        if (set[way].valid && set[way].tag == tag)
         {
-            // flush line to RAM
-            uint32_t flush_base =
-                (index << OFFSET_BITS) | ((uint32_t)(LINE_TAG(line)) << (INDEX_BITS + OFFSET_BITS));
-            psram_write(flush_base, line->data, CACHE_LINE_SIZE);
+            set[way].valid = 0;
+            icache_generation++;
         }
+    }
+}
 
-        // get line from RAM
-        uint32_t base = BASE(addr);
-        psram_read(base, line->data, CACHE_LINE_SIZE);
+static void icache_invalidate_range(uint32_t addr, uint32_t size)
+{
+    if (size >= ICACHE_SET_SIZE * ICACHE_WAYS * ICACHE_LINE_SIZE)
+    {
+        memset(icache, 0, sizeof(icache));
+        icache_generation++;
+        return;
+    }
+    for (uint32_t line = IBASE(addr); line < addr + size; line += ICACHE_LINE_SIZE)
+        icache_invalidate(line);
+}
+#endif
+
+uint8_t *icache_line(uint32_t addr, uint32_t *size)
+{
+#if ICACHE_SET_SIZE
+    *size = ICACHE_LINE_SIZE;
+    return icache_lookup(addr)->data;
+#else
+    *size = CACHE_LINE_SIZE;
+    cacheline_t *line = cache_lookup(addr, 1);
+    if (line->present != FULL_MASK)
+        fill_line(line, addr);
+    return line->data;
+#endif
+}
+
+// Copy size bytes between a line and ptr, with the common sizes as single
+// loads/stores.
+#define COPY_SIZED(dst, src, size)  \
+    switch (size)                   \
+    {                               \
+    case 4:                         \
+        memcpy(dst, src, 4);        \
+        break;                      \
+    case 2:                         \
+        memcpy(dst, src, 2);        \
+        break;                      \
+    case 1:                         \
+        *(uint8_t *)(dst) = *(uint8_t *)(src); \
+        break;                      \
+    default:                        \
+        memcpy(dst, src, size);     \
+        break;                      \
+    }
+
+uint64_t cache_stat(uint32_t n)
+{
+#if CACHE_STATS
+    if (n == CACHE_STAT_PREFETCH_USEFUL)
+        return cache_prefetch_useful;
+    if (n == CACHE_STAT_PREFETCH_WASTED)
+        return cache_prefetch_wasted;
+    if (n < CACHE_STAT_SET_CONFLICTS)
+        return stats[n];
+    if (n - CACHE_STAT_SET_CONFLICTS < CACHE_SET_SIZE)
+        return set_conflicts[n - CACHE_STAT_SET_CONFLICTS];
+#else
+    (void)n;
+#endif
+    return 0;
+}
+
+void cache_clear_stats(void)
+{
+#if CACHE_STATS
+    memset(stats, 0, sizeof(stats));
+    memset(set_conflicts, 0, sizeof(set_conflicts));
+#endif
+    cache_prefetch_useful = 0;
+    cache_prefetch_wasted = 0;
+}
+
+void cache_read(uint32_t addr, void *ptr, uint8_t size)
+{
+    uint8_t offset = OFFSET(addr);
 
-        line->tag = tag; // set the tag of the line
-        SET_VALID(line); // mark the line as valid
+    if (offset + size > CACHE_LINE_SIZE) // misaligned access spanning two lines
+    {
+        uint8_t first = CACHE_LINE_SIZE - offset;
+        cache_read(addr, ptr, first);
+        cache_read(addr + first, (uint8_t *)ptr + first, size - first);
+        return;
+    }
+
+    cacheline_t *line = cache_lookup(addr, 1);
+    uint32_t mask = WORD_MASK(offset, size);
+
+    if ((line->present & mask) != mask)
+        fill_line(line, addr);
+
+    COPY_SIZED(ptr, line->data + offset, size);
+}
+
+void cache_write(uint32_t addr, void *ptr, uint8_t size)
+{
+    uint8_t offset = OFFSET(addr);
+
+    if (offset + size > CACHE_LINE_SIZE) // misaligned access spanning two lines
+    {
+        uint8_t first = CACHE_LINE_SIZE - offset;
+        cache_write(addr, ptr, first);
+        cache_write(addr + first, (uint8_t *)ptr + first, size - first);
+        return;
     }
-    /*
-        if (offset + size > CACHE_LINE_SIZE)
+
+    cacheline_t *line = cache_lookup(addr, 0);
+    uint32_t mask = WORD_MASK(offset, size);
+
+    // Whole aligned words can simply be taken over, anything narrower needs
+    // the rest of its word from PSRAM.
+    if ((line->present & mask) != mask && ((offset | size) & 3))
+        fill_line(line, addr);
+    line->present |= mask;
+
+    COPY_SIZED(line->data + offset, ptr, size);
+    SET_DIRTY(line); // mark the line as dirty
+    MARK_DIRTY_SET(INDEX(addr));
+
+#if ICACHE_SET_SIZE
+    icache_invalidate(addr);
+    if (IBASE(addr) != IBASE((addr + size - 1)))
+        icache_invalidate(addr + size - 1);
+#endif
+}
+
+// Bulk copies for DMA-style transfers. Lines that are cached (including the
+// victim buffer) are copied to or from in place, runs of lines that aren't
+// go straight to PSRAM in one burst each. Nothing is allocated, so moving a
+// large buffer doesn't evict the working set.
+void cache_read_block(uint32_t addr, void *buf, uint32_t size)
+{
+    uint8_t *p = buf;
+    uint32_t run = addr; // start of the uncached bytes not read yet
+
+    while (size)
+    {
+        uint32_t offset = OFFSET(addr);
+        uint32_t len = CACHE_LINE_SIZE - offset;
+        if (len > size)
+            len = size;
+
+        cacheline_t *line = cache_probe(addr);
+        if (line)
+        {
+            if (run != addr)
+                psram_read(run, p - (addr - run), addr - run);
+
+            uint32_t mask = WORD_MASK(offset, len);
+            if ((line->present & mask) != mask)
+                fill_line(line, addr);
+            memcpy(p, line->data + offset, len);
+            run = addr + len;
+        }
+
+        addr += len;
+        p += len;
+        size -= len;
+    }
+
+    if (run != addr)
+        psram_read(run, p - (addr - run), addr - run);
+}
+
+void cache_write_block(uint32_t addr, void *buf, uint32_t size)
+{
+    uint8_t *p = buf;
+    uint32_t run = addr; // start of the uncached bytes not written yet
+#if ICACHE_SET_SIZE
+    icache_invalidate_range(addr, size);
+#endif
+
+    while (size)
+    {
+        uint32_t offset = OFFSET(addr);
+        uint32_t len = CACHE_LINE_SIZE - offset;
+        if (len > size)
+            len = size;
+
+        cacheline_t *line = cache_probe(addr);
+        if (line)
         {
-            // printf("cross boundary write!\n");
-            size = CACHE_LINE_SIZE - offset;
+            if (run != addr)
+                psram_write(run, p - (addr - run), addr - run);
+
+            uint32_t mask = WORD_MASK(offset, len);
+            if ((line->present & mask) != mask && ((offset | len) & 3))
+                fill_line(line, addr);
+            line->present |= mask;
+            memcpy(line->data + offset, p, len);
+            SET_DIRTY(line);
+            MARK_DIRTY_SET(INDEX(addr));
+            run = addr + len;
         }
-    */
 
-    while (size--)
-        line->data[offset++] = *(uint8_t *)(ptr++);
+        addr += len;
+        p += len;
+        size -= len;
+    }
 
-    // for ( int i = 0; i < size; i++ ) line->data[offset + i] = ( (uint8_t *)( ptr ) )[i];
-    SET_DIRTY(line); // mark the line as dirty
+    if (run != addr)
+        psram_write(run, p - (addr - run), addr - run);
 }
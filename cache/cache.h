@@ -8,4 +8,40 @@ void cache_flush(void);
 void cache_write(uint32_t ofs, void *buf, uint8_t size);
 void cache_read(uint32_t ofs, void *buf, uint8_t size);
 
+// Copy whole buffers between guest RAM and the host, coherently with the
+// cache but without allocating lines for them.
+void cache_read_block(uint32_t ofs, void *buf, uint32_t size);
+void cache_write_block(uint32_t ofs, void *buf, uint32_t size);
+
+// Instruction fetches read whole lines from the instruction cache, which
+// cache_write keeps coherent. icache_line returns the line holding ofs and
+// its size; icache_generation is bumped whenever a line is refilled or
+// invalidated, which invalidates every pointer icache_line returned.
+extern uint32_t icache_generation;
+uint8_t *icache_line(uint32_t ofs, uint32_t *size);
+
+// Lines read ahead of a sequential stream of misses that were used before
+// being evicted, and those that were not.
+extern uint32_t cache_prefetch_useful, cache_prefetch_wasted;
+
+// Counters kept when CACHE_STATS is set, all 0 otherwise. With the
+// instruction cache disabled, fetches count as data accesses.
+enum cacheStat
+{
+    CACHE_STAT_IHITS,           // instruction line lookups that hit
+    CACHE_STAT_IMISSES,         // and that missed
+    CACHE_STAT_DHITS,           // data line lookups (loads and stores) that hit
+    CACHE_STAT_DMISSES,         // and that missed
+    CACHE_STAT_DIRTY_EVICTIONS, // data lines written back to make room
+    CACHE_STAT_PSRAM_READ,      // bytes read from PSRAM
+    CACHE_STAT_PSRAM_WRITE,     // bytes written to PSRAM
+    CACHE_STAT_PREFETCH_USEFUL, // cache_prefetch_useful
+    CACHE_STAT_PREFETCH_WASTED, // cache_prefetch_wasted
+    CACHE_STAT_VICTIM_HITS,     // data misses served from the victim buffer
+    CACHE_STAT_SET_CONFLICTS,   // + index: data misses in that set that replaced a valid line
+};
+
+uint64_t cache_stat(uint32_t n);
+void cache_clear_stats(void);
+
 #endif
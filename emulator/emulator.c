@@ -1,4 +1,5 @@
 #include <stddef.h>
+#include <string.h>
 
 #include "emulator.h"
 #include "../psram/psram.h"
@@ -11,6 +12,50 @@
 
 #include "vm_config.h"
 
+#ifndef EMULATOR_PREDECODE_ENTRIES
+#define EMULATOR_PREDECODE_ENTRIES 256
+#endif
+
+#ifndef EMULATOR_RVC
+#define EMULATOR_RVC 1
+#endif
+
+#ifndef EMULATOR_ZB
+#define EMULATOR_ZB 1
+#endif
+
+#ifndef EMULATOR_FUSION
+#define EMULATOR_FUSION 0
+#endif
+
+#ifndef EMULATOR_BLOCK_ENGINE
+#define EMULATOR_BLOCK_ENGINE 0
+#endif
+
+#ifndef EMULATOR_JIT
+#define EMULATOR_JIT 0
+#endif
+
+#ifndef EMULATOR_MMIO_REGIONS
+#define EMULATOR_MMIO_REGIONS 16
+#endif
+
+#ifndef EMULATOR_MAX_SLICE
+#define EMULATOR_MAX_SLICE 16384
+#endif
+
+#ifndef EMULATOR_IDLE_MAX_US
+#define EMULATOR_IDLE_MAX_US 100000
+#endif
+
+#ifndef EMULATOR_IDLE_POLL_US
+#define EMULATOR_IDLE_POLL_US 10000
+#endif
+
+#ifndef EMULATOR_IDLE_WAKE
+#define EMULATOR_IDLE_WAKE() console_available()
+#endif
+
 int time_divisor = EMULATOR_TIME_DIV;
 int fixed_update = EMULATOR_FIXED_UPDATE;
 int do_sleep = 1;
@@ -30,12 +75,29 @@ unsigned long blk_offs;
 unsigned long blk_ram_ptr;
 FRESULT blk_err;
 
+#if CACHE_STATS
+uint32_t cache_stat_sel;
+#endif
+
 static inline uint32_t HandleException(uint32_t ir, uint32_t retval);
-static uint32_t HandleControlStore(uint32_t addy, uint32_t val);
-static uint32_t HandleControlLoad(uint32_t addy);
+static uint32_t vm_mmio_store(uint32_t addr, uint32_t val);
+static uint32_t vm_mmio_load(uint32_t addr);
+static uint32_t uart_read(uint32_t ofs);
+static uint32_t uart_write(uint32_t ofs, uint32_t val);
+static uint32_t clint_read(uint32_t ofs);
+static uint32_t clint_write(uint32_t ofs, uint32_t val);
+static uint32_t syscon_write(uint32_t ofs, uint32_t val);
 static void HandleOtherCSRWrite(uint16_t csrno, uint32_t value);
 static uint32_t HandleOtherCSRRead(uint16_t csrno);
 
+#if EMULATOR_JIT
+struct MiniRV32IMAState;
+static int jit_run(struct MiniRV32IMAState *state, uint32_t *pc);
+static int jit_invalidate(uint32_t ofs, uint32_t len);
+#define MINIRV32_RUN_TRANSLATED(state, pc) jit_run(state, pc)
+#define MINIRV32_CODE_WRITTEN(ofs, len) jit_invalidate(ofs, len)
+#endif
+
 #define MINIRV32WARN(x...) // consoleprintf(x);
 #define MINIRV32_DECORATE static
 #define MINI_RV32_RAM_SIZE ram_amt
@@ -52,10 +114,10 @@ static uint32_t HandleOtherCSRRead(uint16_t csrno);
                 retval = HandleException(ir, retval); \
         }                                             \
     }
-#define MINIRV32_HANDLE_MEM_STORE_CONTROL(addy, val) \
-    if (HandleControlStore(addy, val))               \
-        return val;
-#define MINIRV32_HANDLE_MEM_LOAD_CONTROL(addy, rval) rval = HandleControlLoad(addy);
+#define MINIRV32_CUSTOM_MMIO
+#define MINIRV32_MMIO_STORE(addy, val) vm_mmio_store(addy, val)
+#define MINIRV32_MMIO_LOAD(addy) vm_mmio_load(addy)
+#define MINIRV32_MMIO_YIELD VM_MMIO_YIELD
 #define MINIRV32_OTHERCSR_WRITE(csrno, value) HandleOtherCSRWrite(csrno, value);
 #define MINIRV32_OTHERCSR_READ(csrno, rval) \
     {                                       \
@@ -64,6 +126,25 @@ static uint32_t HandleOtherCSRRead(uint16_t csrno);
 
 #define MINIRV32_CUSTOM_MEMORY_BUS
 
+#if EMULATOR_RVC
+#define MINIRV32_RVC
+#endif
+
+#if EMULATOR_ZB
+#define MINIRV32_ZB
+#endif
+
+#if EMULATOR_PREDECODE_ENTRIES
+#define MINIRV32_PREDECODE
+#define MINIRV32_PREDECODE_ENTRIES EMULATOR_PREDECODE_ENTRIES
+#if EMULATOR_BLOCK_ENGINE
+#define MINIRV32_BLOCK_ENGINE
+#endif
+#if EMULATOR_FUSION
+#define MINIRV32_FUSION
+#endif
+#endif
+
 #define MINIRV32_STORE4(ofs, val) cache_write(ofs, &val, 4)
 #define MINIRV32_STORE2(ofs, val) cache_write(ofs, &val, 2)
 #define MINIRV32_STORE1(ofs, val) cache_write(ofs, &val, 1)
@@ -103,8 +184,43 @@ static inline int16_t MINIRV32_LOAD2_SIGNED(uint32_t ofs)
     return val;
 }
 
+// Instruction fetch keeps a pointer to the current I-cache line and reads
+// straight from it until the PC leaves the line or the line is refilled.
+static const uint8_t *fetch_line;
+static uint32_t fetch_base = 1;
+static uint32_t fetch_limit; // Last offset in the line a 4-byte fetch can start at.
+static uint32_t fetch_generation;
+
+static inline uint32_t fetch4(uint32_t ofs)
+{
+    uint32_t offset = ofs - fetch_base;
+
+    if (offset > fetch_limit || fetch_generation != icache_generation)
+    {
+        uint32_t size;
+        fetch_line = icache_line(ofs, &size);
+        fetch_base = ofs & ~(size - 1);
+        fetch_limit = size - 4;
+        fetch_generation = icache_generation;
+
+        offset = ofs - fetch_base;
+        if (offset > fetch_limit) // 4-byte instruction at a 2-byte offset (RVC) straddling two lines
+            return MINIRV32_LOAD2(ofs) | ((uint32_t)MINIRV32_LOAD2(ofs + 2) << 16);
+    }
+
+    uint32_t val;
+    memcpy(&val, fetch_line + offset, 4);
+    return val;
+}
+
+#define MINIRV32_FETCH4(ofs) fetch4(ofs)
+
 #include "mini-rv32ima.h"
 
+#if EMULATOR_JIT
+#include "jit.h"
+#endif
+
 struct MiniRV32IMAState core;
 
 const char spinner[] = "/-\\|";
@@ -140,8 +256,21 @@ uint8_t vm_save_powerstate(uint8_t state)
     return rc;
 }
 
+uint64_t vm_get_fused_pairs(void)
+{
+#ifdef MINIRV32_FUSION
+    return MiniRV32IMAFusedPairs;
+#else
+    return 0;
+#endif
+}
+
 void vm_init_hw(void)
 {
+    vm_register_mmio(0x10000000, 0x8, uart_read, uart_write);
+    vm_register_mmio(0x11000000, 0x10000, clint_read, clint_write);
+    vm_register_mmio(0x11100000, 0x1000, NULL, syscon_write);
+
     if (psram_init())
         console_puts("PSRAM OK\n\r");
     else
@@ -182,7 +311,7 @@ void psram_load_file(uint32_t addr)
         if (!br)
             break; /* Error or end of file */
 
-        psram_access(addr, br, true, blk_buf);
+        cache_write_block(addr, blk_buf, br);
         total_bytes += br;
         addr += br;
 
@@ -195,12 +324,81 @@ void psram_load_file(uint32_t addr)
     }
 }
 
+// Guest microseconds until the CLINT timer interrupt becomes pending, capped
+// at EMULATOR_IDLE_MAX_US (also used when no timer is armed).
+static uint32_t vm_idle_us(void)
+{
+    uint64_t timer = ((uint64_t)core.timerh << 32) | core.timerl;
+    uint64_t match = ((uint64_t)core.timermatchh << 32) | core.timermatchl;
+
+    if (!match)
+        return EMULATOR_IDLE_MAX_US;
+    if (match < timer)
+        return 0;
+    // The interrupt fires once the timer is strictly past timermatch.
+    if (match - timer >= EMULATOR_IDLE_MAX_US)
+        return EMULATOR_IDLE_MAX_US;
+    return match - timer + 1;
+}
+
+// Instructions to run before the CLINT timer is next due, capped at
+// EMULATOR_MAX_SLICE. elapsedUs is what MiniRV32IMAStep is about to add to
+// the timer. With fixed_update the slice ends on the first cycle the timer
+// is past timermatch; otherwise it is estimated from per_us, the
+// instructions the guest retired per microsecond in the last slice.
+static int vm_slice(uint64_t lastTime, uint32_t elapsedUs, uint32_t per_us)
+{
+    uint64_t timer = (((uint64_t)core.timerh << 32) | core.timerl) + elapsedUs;
+    uint64_t match = ((uint64_t)core.timermatchh << 32) | core.timermatchl;
+    uint64_t slice;
+
+    if (!match)
+        return EMULATOR_MAX_SLICE;
+    // Already pending but masked: interrupts are only taken on entry to
+    // MiniRV32IMAStep, so come back soon in case the guest unmasks it.
+    if (match < timer)
+        return EMULATOR_MAX_SLICE < 1024 ? EMULATOR_MAX_SLICE : 1024;
+    if (match - timer >= EMULATOR_MAX_SLICE)
+        return EMULATOR_MAX_SLICE;
+
+    if (fixed_update)
+        slice = (lastTime + match - timer + 1) * time_divisor - (((uint64_t)core.cycleh << 32) | core.cyclel);
+    else
+        slice = (match - timer + 1) * per_us;
+    return slice < EMULATOR_MAX_SLICE ? slice : EMULATOR_MAX_SLICE;
+}
+
+// Sleep for up to us host microseconds while the guest sits in WFI. Returns
+// early, ending the WFI, when EMULATOR_IDLE_WAKE() reports console input or
+// another wake event.
+static void vm_idle_wait(uint64_t us)
+{
+    while (us)
+    {
+        uint32_t step = us < EMULATOR_IDLE_POLL_US ? us : EMULATOR_IDLE_POLL_US;
+        timing_delay_us(step);
+        us -= step;
+
+        if (EMULATOR_IDLE_WAKE())
+        {
+            core.extraflags &= ~4;
+            return;
+        }
+    }
+}
+
 int start_vm(int prev_power_state)
 {
     while (!pwr_button() && prev_power_state != EMU_REBOOT)
         ;
 
     cache_reset();
+#ifdef MINIRV32_PREDECODE
+    MiniRV32IMAPredecodeFlush();
+#endif
+#if EMULATOR_JIT
+    jit_flush();
+#endif
 
     if (prev_power_state == EMU_GET_SD)
         prev_power_state = vm_get_powerstate();
@@ -294,7 +492,10 @@ int start_vm(int prev_power_state)
     uint64_t rt;
     uint64_t lastTime = (fixed_update) ? 0 : (timing_micros() / time_divisor);
 
-    int instrs_per_flip = single_step ? 1 : 4096;
+    int instrs_per_flip = 1;
+    uint32_t per_us = time_divisor; // Measured from the last slice when not in fixed_update.
+    uint64_t slice_start = 0;
+    int ran = 0;
     for (rt = 0; rt < instct + 1 || instct < 0; rt += instrs_per_flip)
     {
         uint64_t *this_ccount = ((uint64_t *)&core.cyclel);
@@ -305,15 +506,36 @@ int start_vm(int prev_power_state)
             elapsedUs = timing_micros() / time_divisor - lastTime;
         lastTime += elapsedUs;
 
-        int ret = MiniRV32IMAStep(&core, NULL, 0, elapsedUs, instrs_per_flip); // Execute upto 1024 cycles before breaking out.
+        if (!fixed_update && ran && elapsedUs)
+        {
+            uint64_t rate = (*this_ccount - slice_start) / elapsedUs;
+            per_us = rate ? rate : 1;
+        }
+
+        if (!single_step)
+            instrs_per_flip = vm_slice(lastTime, elapsedUs, per_us);
+        slice_start = *this_ccount;
+
+        int ret = MiniRV32IMAStep(&core, NULL, 0, elapsedUs, instrs_per_flip); // Run until the next timer deadline, at most EMULATOR_MAX_SLICE instructions.
+        ran = ret == 0;
         switch (ret)
         {
         case 0:
             break;
         case 1:
-            if (do_sleep)
-                timing_delay_ms(1);
-            *this_ccount += instrs_per_flip;
+            if (fixed_update)
+            {
+                // Guest time follows the cycle counter, so skip straight to the next timer deadline.
+                uint64_t deadline = (lastTime + vm_idle_us()) * time_divisor;
+                if (*this_ccount < deadline)
+                    *this_ccount = deadline;
+            }
+            else
+            {
+                if (do_sleep)
+                    vm_idle_wait((uint64_t)vm_idle_us() * time_divisor);
+                *this_ccount += instrs_per_flip;
+            }
             break;
         case 3:
             instct = 0;
@@ -333,7 +555,6 @@ int start_vm(int prev_power_state)
         if (hibernate_request)
         {
             vm_save_powerstate(EMU_HIBERNATE);
-            cache_flush();
 
             rc = pf_open(SNAPSHOT_FILENAME);
             if (rc)
@@ -349,7 +570,7 @@ int start_vm(int prev_power_state)
 
             for (int i = 0; i < chunks; i++)
             {
-                psram_access(addr, sizeof(blk_buf), false, blk_buf);
+                cache_read_block(addr, blk_buf, sizeof(blk_buf));
                 addr += sizeof(blk_buf);
 
                 rc = pf_write(blk_buf, 512, &bw);
@@ -425,11 +646,8 @@ static inline void HandleOtherCSRWrite(uint16_t csrno, uint32_t value)
             if (value)
             {
                 //  printf("block op write\n");
-                for (int i = 0; i < 512 / 4; i++)
-                {
-                    blk_buf[i] = MINIRV32_LOAD4(blk_ram_ptr);
-                    blk_ram_ptr += 4;
-                }
+                cache_read_block(blk_ram_ptr, blk_buf, 512);
+                blk_ram_ptr += 512;
                 int x;
                 blk_err = pf_write(blk_buf, 512, &x);
             }
@@ -437,17 +655,33 @@ static inline void HandleOtherCSRWrite(uint16_t csrno, uint32_t value)
             {
                 int x;
                 blk_err = pf_read(blk_buf, 512, &x);
-                for (int i = 0; i < 512 / 4; i++)
-                {
-                    MINIRV32_STORE4(blk_ram_ptr, blk_buf[i]);
-                    blk_ram_ptr += 4;
-                }
+                cache_write_block(blk_ram_ptr, blk_buf, 512);
+                blk_ram_ptr += 512;
+#ifdef MINIRV32_PREDECODE
+                MiniRV32IMAPredecodeInvalidate(blk_ram_ptr - 512, 512);
+#endif
+#if EMULATOR_JIT
+                jit_invalidate(blk_ram_ptr - 512, 512);
+#endif
                 // printf("block op read\n");
             }
         }
     }
     else if (csrno == 0x170)
         hibernate_request = 1;
+#if CACHE_STATS
+    // Every CSR instruction writes back, csrr the value it just read, so
+    // only 0x163 acts on a write, and only on a nonzero one.
+    else if (csrno == 0x160)
+        cache_stat_sel = value;
+    else if (csrno == 0x161 || csrno == 0x162)
+        ;
+    else if (csrno == 0x163)
+    {
+        if (value)
+            cache_clear_stats();
+    }
+#endif
     else
         custom_csr_write(csrno, value);
 }
@@ -471,25 +705,146 @@ static inline uint32_t HandleOtherCSRRead(uint16_t csrno)
     {
         return blk_err;
     }
+#if CACHE_STATS
+    else if (csrno == 0x160)
+    {
+        return cache_stat_sel;
+    }
+    else if (csrno == 0x161)
+    {
+        return cache_stat(cache_stat_sel);
+    }
+    else if (csrno == 0x162)
+    {
+        return cache_stat(cache_stat_sel) >> 32;
+    }
+    else if (csrno == 0x163)
+    {
+        return 0;
+    }
+#endif
     return custom_csr_read(csrno);
 }
 
 // MMIO handling (8250 UART)
 
-static uint32_t HandleControlStore(uint32_t addy, uint32_t val)
+// MMIO devices, sorted by base address so lookups are a binary search. The
+// last region hit is tried first, as guests tend to hammer one device.
+struct mmio_region
 {
-    if (addy == 0x10000000) // UART 8250 / 16550 Data Buffer
-        console_putc(val);
+    uint32_t base;
+    uint32_t size;
+    vm_mmio_read_fn read;
+    vm_mmio_write_fn write;
+};
+
+static struct mmio_region mmio_regions[EMULATOR_MMIO_REGIONS];
+static int mmio_count;
+static struct mmio_region *mmio_last;
+
+int vm_register_mmio(uint32_t base, uint32_t size, vm_mmio_read_fn read, vm_mmio_write_fn write)
+{
+    if (!size || base < 0x10000000 || base + size > 0x12000000 || base + size < base)
+        return -1;
+    if (mmio_count == EMULATOR_MMIO_REGIONS)
+        return -1;
+
+    int i = mmio_count;
+    while (i > 0 && mmio_regions[i - 1].base > base)
+        i--;
+    if (i > 0 && mmio_regions[i - 1].base + mmio_regions[i - 1].size > base)
+        return -1;
+    if (i < mmio_count && base + size > mmio_regions[i].base)
+        return -1;
+
+    memmove(&mmio_regions[i + 1], &mmio_regions[i], (mmio_count - i) * sizeof(struct mmio_region));
+    mmio_regions[i].base = base;
+    mmio_regions[i].size = size;
+    mmio_regions[i].read = read;
+    mmio_regions[i].write = write;
+    mmio_count++;
+    mmio_last = NULL;
     return 0;
 }
 
-static uint32_t HandleControlLoad(uint32_t addy)
+static struct mmio_region *mmio_find(uint32_t addr)
 {
-    // Emulating a 8250 / 16550 UART
-    if (addy == 0x10000005)
+    if (mmio_last && addr - mmio_last->base < mmio_last->size)
+        return mmio_last;
+
+    int lo = 0, hi = mmio_count - 1;
+    while (lo <= hi)
+    {
+        int mid = (lo + hi) / 2;
+        struct mmio_region *r = &mmio_regions[mid];
+        if (addr < r->base)
+            hi = mid - 1;
+        else if (addr - r->base >= r->size)
+            lo = mid + 1;
+        else
+            return mmio_last = r;
+    }
+    return NULL;
+}
+
+static uint32_t vm_mmio_store(uint32_t addr, uint32_t val)
+{
+    struct mmio_region *r = mmio_find(addr);
+    if (r && r->write)
+        return r->write(addr - r->base, val);
+    return 0;
+}
+
+static uint32_t vm_mmio_load(uint32_t addr)
+{
+    struct mmio_region *r = mmio_find(addr);
+    if (r && r->read)
+        return r->read(addr - r->base);
+    return 0;
+}
+
+// Emulating a 8250 / 16550 UART
+static uint32_t uart_read(uint32_t ofs)
+{
+    if (ofs == 5)
         return 0x60 | console_available();
-    else if (addy == 0x10000000 && console_available())
+    else if (ofs == 0 && console_available())
         return console_read();
 
     return 0;
 }
+
+static uint32_t uart_write(uint32_t ofs, uint32_t val)
+{
+    if (ofs == 0) // Data Buffer
+        console_putc(val);
+    return 0;
+}
+
+// https://chromitem-soc.readthedocs.io/en/latest/clint.html
+static uint32_t clint_read(uint32_t ofs)
+{
+    if (ofs == 0xbffc)
+        return core.timerh;
+    else if (ofs == 0xbff8)
+        return core.timerl;
+
+    return 0;
+}
+
+static uint32_t clint_write(uint32_t ofs, uint32_t val)
+{
+    if (ofs == 0x4004)
+        core.timermatchh = val;
+    else if (ofs == 0x4000)
+        core.timermatchl = val;
+    else
+        return 0;
+    return VM_MMIO_YIELD; // End the slice so start_vm sees the new deadline.
+}
+
+// SYSCON (reboot, poweroff, etc.), the value written is returned by MiniRV32IMAStep.
+static uint32_t syscon_write(uint32_t ofs, uint32_t val)
+{
+    return ofs == 0 ? val : 0;
+}
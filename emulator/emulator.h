@@ -13,9 +13,18 @@ enum emulatorCode
     EMU_UNKNOWN
 };
 
+// MMIO device callbacks, ofs is relative to the start of the region. A write
+// may return VM_MMIO_YIELD to end the current instruction slice, or any other
+// nonzero code to stop the VM with it (SYSCON uses 0x5555 and 0x7777).
+#define VM_MMIO_YIELD 0xffffffff
+typedef uint32_t (*vm_mmio_read_fn)(uint32_t ofs);
+typedef uint32_t (*vm_mmio_write_fn)(uint32_t ofs, uint32_t val);
+
+int vm_register_mmio(uint32_t base, uint32_t size, vm_mmio_read_fn read, vm_mmio_write_fn write);
 int start_vm(int prev_power_state);
 void vm_init_hw(void);
 uint8_t vm_get_powerstate(void);
 uint8_t vm_save_powerstate(uint8_t state);
+uint64_t vm_get_fused_pairs(void);
 
 #endif
\ No newline at end of file
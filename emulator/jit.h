@@ -0,0 +1,589 @@
+#ifndef _JIT_H
+#define _JIT_H
+
+// Host binary translator, included by emulator.c after mini-rv32ima.h when
+// EMULATOR_JIT is set.  Hot guest basic blocks are translated to native code
+// that works directly on struct MiniRV32IMAState, so the interpreter can pick
+// up at any block boundary.  Translated code only covers integer ALU ops,
+// loads/stores to RAM and block-ending jumps and branches; CSR, SYSTEM, AMO
+// and MMIO accesses are left to the interpreter.
+//
+// Only an x86-64 backend exists; on other hosts jit_run() never translates.
+
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#ifndef JIT_BLOCKS
+#define JIT_BLOCKS 4096 // translated block lookup entries, power of 2
+#endif
+
+#ifndef JIT_CODE_SIZE
+#define JIT_CODE_SIZE (4 * 1024 * 1024)
+#endif
+
+#ifndef JIT_HOT_COUNT
+#define JIT_HOT_COUNT 16 // executions before a block is translated
+#endif
+
+#ifndef JIT_MAX_OPS
+#define JIT_MAX_OPS 64
+#endif
+
+#define JIT_PAGE_BITS 10
+#define JIT_PAGES ((EMULATOR_RAM_MB * 1024 * 1024) >> JIT_PAGE_BITS)
+
+// Returns (instructions retired << 32) | next pc.
+typedef uint64_t (*jit_block_fn)(struct MiniRV32IMAState *state);
+
+struct JitBlock
+{
+    uint32_t pc;
+    uint32_t hits;
+    jit_block_fn code; // NULL until translated, or if the block can't be
+};
+
+static struct JitBlock jit_blocks[JIT_BLOCKS];
+static uint8_t jit_code_pages[JIT_PAGES / 8];
+static uint8_t *jit_code;
+static uint32_t jit_code_used;
+
+static void jit_flush(void)
+{
+    memset(jit_blocks, 0, sizeof(jit_blocks));
+    memset(jit_code_pages, 0, sizeof(jit_code_pages));
+    jit_code_used = 0;
+}
+
+// Called for every write to guest RAM.  Returns 1 if translated code was
+// thrown away, in which case the block doing the store must exit.
+static int jit_invalidate(uint32_t ofs, uint32_t len)
+{
+    for (uint32_t page = ofs >> JIT_PAGE_BITS; page <= (ofs + len - 1) >> JIT_PAGE_BITS && page < JIT_PAGES; page++)
+    {
+        if (jit_code_pages[page >> 3] & (1 << (page & 7)))
+        {
+            jit_flush();
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Memory helpers called from translated code, the address is already known to be in RAM.
+static uint32_t jit_load(uint32_t ofs, uint32_t funct3)
+{
+    switch (funct3)
+    {
+    case 0:
+        return MINIRV32_LOAD1_SIGNED(ofs);
+    case 1:
+        return MINIRV32_LOAD2_SIGNED(ofs);
+    case 4:
+        return MINIRV32_LOAD1(ofs);
+    case 5:
+        return MINIRV32_LOAD2(ofs);
+    default:
+        return MINIRV32_LOAD4(ofs);
+    }
+}
+
+static uint32_t jit_store(uint32_t ofs, uint32_t val, uint32_t funct3)
+{
+    switch (funct3)
+    {
+    case 0:
+        MINIRV32_STORE1(ofs, val);
+        break;
+    case 1:
+        MINIRV32_STORE2(ofs, val);
+        break;
+    default:
+        MINIRV32_STORE4(ofs, val);
+        break;
+    }
+#ifdef MINIRV32_PREDECODE
+    MiniRV32IMAPredecodeInvalidate(ofs, 4);
+#endif
+    return jit_invalidate(ofs, 4);
+}
+
+static uint32_t jit_divrem(uint32_t funct3, uint32_t rs1, uint32_t rs2)
+{
+    switch (funct3)
+    {
+    case 4:
+        return (rs2 == 0) ? 0xffffffff : ((int32_t)rs1 == INT32_MIN && (int32_t)rs2 == -1) ? rs1 : (uint32_t)((int32_t)rs1 / (int32_t)rs2);
+    case 5:
+        return (rs2 == 0) ? 0xffffffff : rs1 / rs2;
+    case 6:
+        return (rs2 == 0) ? rs1 : ((int32_t)rs1 == INT32_MIN && (int32_t)rs2 == -1) ? 0 : (uint32_t)((int32_t)rs1 % (int32_t)rs2);
+    default:
+        return (rs2 == 0) ? rs1 : rs1 % rs2;
+    }
+}
+
+// Only the exact encodings below are translated, anything else ends the
+// block and runs in the interpreter.
+static int jit_supported(const struct MiniRV32IMAOp *op)
+{
+    uint32_t funct3 = (op->ir >> 12) & 7;
+    uint32_t funct7 = op->ir >> 25;
+
+    switch (op->opc)
+    {
+    case MINIRV32_OP_LUI:
+    case MINIRV32_OP_AUIPC:
+    case MINIRV32_OP_JAL:
+    case MINIRV32_OP_FENCE:
+        return 1;
+    case MINIRV32_OP_JALR:
+        return funct3 == 0;
+    case MINIRV32_OP_BRANCH:
+        return funct3 != 2 && funct3 != 3;
+    case MINIRV32_OP_LOAD:
+        return funct3 != 3 && funct3 < 6;
+    case MINIRV32_OP_STORE:
+        return funct3 < 3;
+    case MINIRV32_OP_OPIMM:
+        if (funct3 == 1)
+            return funct7 == 0;
+        if (funct3 == 5)
+            return funct7 == 0 || funct7 == 0x20;
+        return 1;
+    case MINIRV32_OP_OP:
+        return funct7 == 0 || (funct7 == 0x20 && (funct3 == 0 || funct3 == 5));
+    case MINIRV32_OP_MULDIV:
+        return funct7 == 1;
+    default:
+        return 0;
+    }
+}
+
+#if defined(__x86_64__)
+
+// Translated blocks are entered as jit_block_fn with rdi = state.  rbx holds
+// the state pointer for the whole block, eax/ecx/edx are scratch, and guest
+// registers live in state->regs only.
+
+#define REG_DISP(r) ((uint32_t)(offsetof(struct MiniRV32IMAState, regs) + (r) * 4))
+
+struct JitEmitter
+{
+    uint8_t *p;
+    uint8_t *end;
+};
+
+static void emit8(struct JitEmitter *e, uint8_t b)
+{
+    if (e->p < e->end)
+        *e->p = b;
+    e->p++;
+}
+
+static void emit32(struct JitEmitter *e, uint32_t v)
+{
+    for (int i = 0; i < 4; i++)
+        emit8(e, v >> (i * 8));
+}
+
+static void emit64(struct JitEmitter *e, uint64_t v)
+{
+    emit32(e, v);
+    emit32(e, v >> 32);
+}
+
+// <opcode> <reg>, [rbx + disp32]
+static void emit_mem(struct JitEmitter *e, uint8_t opcode, uint8_t reg, uint8_t r)
+{
+    emit8(e, opcode);
+    emit8(e, 0x83 | (reg << 3));
+    emit32(e, REG_DISP(r));
+}
+
+#define X86_EAX 0
+#define X86_ECX 1
+#define X86_EDX 2
+#define X86_ESI 6
+#define X86_EDI 7
+
+static void emit_load_reg(struct JitEmitter *e, uint8_t x86, uint8_t r)
+{
+    emit_mem(e, 0x8b, x86, r); // mov x86, [rbx + regs[r]]
+}
+
+static void emit_load_reg_sx64(struct JitEmitter *e, uint8_t x86, uint8_t r)
+{
+    emit8(e, 0x48); // movsxd x86 (64-bit), [rbx + regs[r]]
+    emit_mem(e, 0x63, x86, r);
+}
+
+static void emit_store_eax(struct JitEmitter *e, uint8_t r)
+{
+    if (r)
+        emit_mem(e, 0x89, X86_EAX, r); // mov [rbx + regs[r]], eax
+}
+
+static void emit_store_imm(struct JitEmitter *e, uint8_t r, uint32_t imm)
+{
+    if (!r)
+        return;
+    emit8(e, 0xc7); // mov dword [rbx + regs[r]], imm32
+    emit8(e, 0x83);
+    emit32(e, REG_DISP(r));
+    emit32(e, imm);
+}
+
+static void emit_alu_imm(struct JitEmitter *e, uint8_t ext, uint32_t imm)
+{
+    emit8(e, 0x81); // <alu> eax, imm32
+    emit8(e, 0xc0 | (ext << 3));
+    emit32(e, imm);
+}
+
+static void emit_setcc(struct JitEmitter *e, uint8_t cc)
+{
+    emit8(e, 0x0f); // setcc al; movzx eax, al
+    emit8(e, 0x90 | cc);
+    emit8(e, 0xc0);
+    emit8(e, 0x0f);
+    emit8(e, 0xb6);
+    emit8(e, 0xc0);
+}
+
+static void emit_call(struct JitEmitter *e, const void *fn)
+{
+    emit8(e, 0x48); // mov rax, fn; call rax
+    emit8(e, 0xb8);
+    emit64(e, (uint64_t)(uintptr_t)fn);
+    emit8(e, 0xff);
+    emit8(e, 0xd0);
+}
+
+static void emit_mov_imm(struct JitEmitter *e, uint8_t x86, uint32_t imm)
+{
+    emit8(e, 0xb8 | x86); // mov r32, imm32
+    emit32(e, imm);
+}
+
+// Leave the block: rax = (retired << 32) | pc.  12 bytes.
+static void emit_exit(struct JitEmitter *e, uint32_t pc, uint32_t retired)
+{
+    emit8(e, 0x48); // mov rax, imm64
+    emit8(e, 0xb8);
+    emit64(e, ((uint64_t)retired << 32) | pc);
+    emit8(e, 0x5b); // pop rbx
+    emit8(e, 0xc3); // ret
+}
+
+// eax = guest address of a load/store; leaves the RAM offset in eax or exits
+// the block before op number n so the interpreter handles MMIO and faults.
+static void emit_ram_check(struct JitEmitter *e, uint32_t imm, uint32_t pc, uint32_t n)
+{
+    emit_alu_imm(e, 0, imm - MINIRV32_RAM_IMAGE_OFFSET); // add eax, imm - offset
+    emit_alu_imm(e, 7, MINI_RV32_RAM_SIZE - 3);          // cmp eax, ram - 3
+    emit8(e, 0x72);                                      // jb over the exit
+    emit8(e, 12);
+    emit_exit(e, pc, n);
+}
+
+static const uint8_t jit_branch_cc[8] = {0x4, 0x5, 0, 0, 0xc, 0xd, 0x2, 0x3}; // e, ne, -, -, l, ge, b, ae
+
+static int jit_emit_op(struct JitEmitter *e, const struct MiniRV32IMAOp *op, uint32_t pc, uint32_t n)
+{
+    uint32_t funct3 = (op->ir >> 12) & 7;
+    uint32_t alt = op->ir & 0x40000000;
+
+    switch (op->opc)
+    {
+    case MINIRV32_OP_LUI:
+        emit_store_imm(e, op->rd, op->imm);
+        break;
+    case MINIRV32_OP_AUIPC:
+        emit_store_imm(e, op->rd, pc + op->imm);
+        break;
+    case MINIRV32_OP_FENCE:
+        break;
+    case MINIRV32_OP_OPIMM:
+        if (!op->rd)
+            break;
+        emit_load_reg(e, X86_EAX, op->rs1);
+        switch (funct3)
+        {
+        case 0:
+            emit_alu_imm(e, 0, op->imm); // add
+            break;
+        case 1:
+            emit8(e, 0xc1); // shl eax, imm8
+            emit8(e, 0xe0);
+            emit8(e, op->imm & 0x1f);
+            break;
+        case 2:
+            emit_alu_imm(e, 7, op->imm);
+            emit_setcc(e, 0xc); // setl
+            break;
+        case 3:
+            emit_alu_imm(e, 7, op->imm);
+            emit_setcc(e, 0x2); // setb
+            break;
+        case 4:
+            emit_alu_imm(e, 6, op->imm); // xor
+            break;
+        case 5:
+            emit8(e, 0xc1); // sar/shr eax, imm8
+            emit8(e, alt ? 0xf8 : 0xe8);
+            emit8(e, op->imm & 0x1f);
+            break;
+        case 6:
+            emit_alu_imm(e, 1, op->imm); // or
+            break;
+        case 7:
+            emit_alu_imm(e, 4, op->imm); // and
+            break;
+        }
+        emit_store_eax(e, op->rd);
+        break;
+    case MINIRV32_OP_OP:
+        if (!op->rd)
+            break;
+        emit_load_reg(e, X86_EAX, op->rs1);
+        switch (funct3)
+        {
+        case 0:
+            emit_mem(e, alt ? 0x2b : 0x03, X86_EAX, op->rs2); // sub/add eax, [rs2]
+            break;
+        case 1:
+        case 5:
+            emit_load_reg(e, X86_ECX, op->rs2);
+            emit8(e, 0xd3); // shl/shr/sar eax, cl
+            emit8(e, funct3 == 1 ? 0xe0 : alt ? 0xf8 : 0xe8);
+            break;
+        case 2:
+        case 3:
+            emit_mem(e, 0x3b, X86_EAX, op->rs2); // cmp eax, [rs2]
+            emit_setcc(e, funct3 == 2 ? 0xc : 0x2);
+            break;
+        case 4:
+            emit_mem(e, 0x33, X86_EAX, op->rs2);
+            break;
+        case 6:
+            emit_mem(e, 0x0b, X86_EAX, op->rs2);
+            break;
+        case 7:
+            emit_mem(e, 0x23, X86_EAX, op->rs2);
+            break;
+        }
+        emit_store_eax(e, op->rd);
+        break;
+    case MINIRV32_OP_MULDIV:
+        if (!op->rd)
+            break;
+        if (funct3 == 0)
+        {
+            emit_load_reg(e, X86_EAX, op->rs1);
+            emit8(e, 0x0f); // imul eax, [rs2]
+            emit_mem(e, 0xaf, X86_EAX, op->rs2);
+        }
+        else if (funct3 < 4)
+        {
+            // 64-bit product of the sign- or zero-extended operands, keep the top half.
+            if (funct3 == 3)
+                emit_load_reg(e, X86_EAX, op->rs1);
+            else
+                emit_load_reg_sx64(e, X86_EAX, op->rs1);
+            if (funct3 == 1)
+                emit_load_reg_sx64(e, X86_ECX, op->rs2);
+            else
+                emit_load_reg(e, X86_ECX, op->rs2);
+            emit8(e, 0x48); // imul rax, rcx
+            emit8(e, 0x0f);
+            emit8(e, 0xaf);
+            emit8(e, 0xc1);
+            emit8(e, 0x48); // shr rax, 32
+            emit8(e, 0xc1);
+            emit8(e, 0xe8);
+            emit8(e, 32);
+        }
+        else
+        {
+            emit_mov_imm(e, X86_EDI, funct3);
+            emit_load_reg(e, X86_ESI, op->rs1);
+            emit_load_reg(e, X86_EDX, op->rs2);
+            emit_call(e, (const void *)jit_divrem);
+        }
+        emit_store_eax(e, op->rd);
+        break;
+    case MINIRV32_OP_LOAD:
+        emit_load_reg(e, X86_EAX, op->rs1);
+        emit_ram_check(e, op->imm, pc, n);
+        emit8(e, 0x89); // mov edi, eax
+        emit8(e, 0xc7);
+        emit_mov_imm(e, X86_ESI, funct3);
+        emit_call(e, (const void *)jit_load);
+        emit_store_eax(e, op->rd);
+        break;
+    case MINIRV32_OP_STORE:
+        emit_load_reg(e, X86_EAX, op->rs1);
+        emit_ram_check(e, op->imm, pc, n);
+        emit8(e, 0x89); // mov edi, eax
+        emit8(e, 0xc7);
+        emit_load_reg(e, X86_ESI, op->rs2);
+        emit_mov_imm(e, X86_EDX, funct3);
+        emit_call(e, (const void *)jit_store);
+        emit8(e, 0x85); // test eax, eax
+        emit8(e, 0xc0);
+        emit8(e, 0x74); // jz over the exit
+        emit8(e, 12);
+        emit_exit(e, pc + op->len, n + 1); // the store hit translated code, which is now gone
+        break;
+    case MINIRV32_OP_JAL:
+        emit_store_imm(e, op->rd, pc + op->len);
+        emit_exit(e, pc + op->imm, n + 1);
+        return 1;
+    case MINIRV32_OP_JALR:
+        emit_load_reg(e, X86_EAX, op->rs1);
+        emit_alu_imm(e, 0, op->imm);
+        emit_alu_imm(e, 4, ~1u);
+        emit_store_imm(e, op->rd, pc + op->len);
+        emit8(e, 0x48); // mov rcx, retired << 32
+        emit8(e, 0xb9);
+        emit64(e, (uint64_t)(n + 1) << 32);
+        emit8(e, 0x48); // or rax, rcx
+        emit8(e, 0x09);
+        emit8(e, 0xc8);
+        emit8(e, 0x5b); // pop rbx
+        emit8(e, 0xc3); // ret
+        return 1;
+    case MINIRV32_OP_BRANCH:
+        emit_load_reg(e, X86_EAX, op->rs1);
+        emit_mem(e, 0x3b, X86_EAX, op->rs2); // cmp eax, [rs2]
+        emit8(e, 0x48);                     // mov rax, not taken
+        emit8(e, 0xb8);
+        emit64(e, ((uint64_t)(n + 1) << 32) | (pc + op->len));
+        emit8(e, 0x48); // mov rcx, taken
+        emit8(e, 0xb9);
+        emit64(e, ((uint64_t)(n + 1) << 32) | (pc + op->imm));
+        emit8(e, 0x48); // cmovcc rax, rcx
+        emit8(e, 0x0f);
+        emit8(e, 0x40 | jit_branch_cc[funct3]);
+        emit8(e, 0xc1);
+        emit8(e, 0x5b); // pop rbx
+        emit8(e, 0xc3); // ret
+        return 1;
+    }
+    return 0;
+}
+
+static jit_block_fn jit_translate(uint32_t pc)
+{
+    if (!jit_code)
+    {
+        void *mem = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED)
+            return NULL;
+        jit_code = mem;
+    }
+
+    struct JitEmitter e = {jit_code + jit_code_used, jit_code + JIT_CODE_SIZE};
+    uint8_t *start = e.p;
+    uint32_t n = 0;
+    uint32_t ofs = pc - MINIRV32_RAM_IMAGE_OFFSET;
+    uint32_t first_ofs = ofs;
+    uint32_t last_ofs = ofs; // last byte of the translated code
+
+    emit8(&e, 0x53); // push rbx
+    emit8(&e, 0x48); // mov rbx, rdi
+    emit8(&e, 0x89);
+    emit8(&e, 0xfb);
+
+    for (;;)
+    {
+        if (n == JIT_MAX_OPS || ofs >= MINI_RV32_RAM_SIZE || (ofs & (MINIRV32_IALIGN - 1)) || MINIRV32_FETCH_PAST_END(ofs))
+        {
+            emit_exit(&e, pc, n);
+            break;
+        }
+
+        struct MiniRV32IMAOp op;
+        MiniRV32IMADecode(&op, MINIRV32_FETCH_INSN(ofs));
+        if (!jit_supported(&op))
+        {
+            emit_exit(&e, pc, n);
+            break;
+        }
+        last_ofs = ofs + op.len - 1;
+        if (jit_emit_op(&e, &op, pc, n))
+        {
+            n++;
+            break;
+        }
+        n++;
+        pc += op.len;
+        ofs += op.len;
+    }
+
+    if (e.p > e.end)
+    {
+        // Out of code space: start over, the block gets translated again when it is next hot.
+        jit_flush();
+        return NULL;
+    }
+    if (n == 0)
+        return NULL;
+
+    // A 4-byte op at the end of a page (RVC) also covers the next one.
+    for (uint32_t page = first_ofs >> JIT_PAGE_BITS; page <= last_ofs >> JIT_PAGE_BITS && page < JIT_PAGES; page++)
+        jit_code_pages[page >> 3] |= 1 << (page & 7);
+
+    jit_code_used = e.p - jit_code;
+    return (jit_block_fn)start;
+}
+
+#else
+
+static jit_block_fn jit_translate(uint32_t pc)
+{
+    (void)pc;
+    return NULL;
+}
+
+#endif
+
+static uint32_t jit_prev_pc; // pc jit_run() was last called with
+
+// Runs the translated block at *pc, if there is one.  Returns the number of
+// guest instructions retired, 0 if the interpreter has to take this one.
+static int jit_run(struct MiniRV32IMAState *state, uint32_t *pc)
+{
+    struct JitBlock *b = &jit_blocks[(*pc >> 2) & (JIT_BLOCKS - 1)];
+    uint32_t prev = jit_prev_pc;
+
+    jit_prev_pc = *pc;
+    if (b->pc != *pc || !b->code)
+    {
+        // Only block entries (jump and branch targets, trap handlers, where
+        // translated code left off) are counted, not every instruction the
+        // interpreter falls through to.
+        if (*pc - prev == 2 || *pc - prev == 4)
+            return 0;
+
+        if (b->pc != *pc)
+        {
+            b->pc = *pc;
+            b->hits = 0;
+            b->code = NULL;
+        }
+        if (++b->hits != JIT_HOT_COUNT)
+            return 0;
+        b->code = jit_translate(*pc);
+        if (!b->code)
+            return 0;
+    }
+
+    uint64_t r = b->code(state);
+    *pc = (uint32_t)r;
+    jit_prev_pc = *pc; // the next pc is a block entry
+    return r >> 32;
+}
+
+#endif
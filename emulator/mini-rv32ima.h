@@ -53,6 +53,20 @@
 	#define MINIRV32_OTHERCSR_READ(...);
 #endif
 
+// MINIRV32_CUSTOM_MMIO hands the whole 0x10000000-0x12000000 window to
+// MINIRV32_MMIO_LOAD( addy ) and MINIRV32_MMIO_STORE( addy, val ), including
+// the CLINT and SYSCON otherwise built into the core.  A nonzero store result
+// stops the core after the store and is returned from MiniRV32IMAStep, like a
+// SYSCON write; MINIRV32_MMIO_YIELD instead just ends the current slice.
+#ifndef MINIRV32_MMIO_YIELD
+	#define MINIRV32_MMIO_YIELD 0xffffffff
+#endif
+
+// Called after every store the core makes to RAM, e.g. to drop translated code.
+#ifndef MINIRV32_CODE_WRITTEN
+	#define MINIRV32_CODE_WRITTEN( ofs, len )
+#endif
+
 #ifndef MINIRV32_CUSTOM_MEMORY_BUS
 	#define MINIRV32_STORE4( ofs, val ) *(uint32_t*)(image + ofs) = val
 	#define MINIRV32_STORE2( ofs, val ) *(uint16_t*)(image + ofs) = val
@@ -64,6 +78,21 @@
 	#define MINIRV32_LOAD1_SIGNED( ofs ) *(int8_t*)(image + ofs)
 #endif
 
+// Instruction fetch, a separate hook so a bus can give it a faster path.
+#ifndef MINIRV32_FETCH4
+	#define MINIRV32_FETCH4( ofs ) MINIRV32_LOAD4( ofs )
+#endif
+
+#ifdef MINIRV32_RVC
+	// The last halfword of RAM can only hold a compressed instruction, don't read past it.
+	#define MINIRV32_FETCH_INSN( ofs ) ( ( (ofs) + 4 > MINI_RV32_RAM_SIZE ) ? (uint32_t)MINIRV32_LOAD2( ofs ) : MINIRV32_FETCH4( ofs ) )
+	// A 32-bit encoding there runs past the end of RAM: instruction access fault.
+	#define MINIRV32_FETCH_PAST_END( ofs ) ( (ofs) + 4 > MINI_RV32_RAM_SIZE && ( MINIRV32_LOAD2( ofs ) & 3 ) == 3 )
+#else
+	#define MINIRV32_FETCH_INSN( ofs ) MINIRV32_FETCH4( ofs )
+	#define MINIRV32_FETCH_PAST_END( ofs ) 0
+#endif
+
 // As a note: We quouple-ify these, because in HLSL, we will be operating with
 // uint4's.  We are going to uint4 data to/from system RAM.
 //
@@ -98,6 +127,144 @@ struct MiniRV32IMAState
 	uint32_t extraflags;
 };
 
+// An instruction with its fields already pulled apart.  The interpreter
+// always executes from one of these; with MINIRV32_PREDECODE they are also
+// kept in a direct-mapped table keyed by guest PC, so a hot loop skips both
+// the MINIRV32_LOAD4 fetch and the field extraction.
+struct MiniRV32IMAOp
+{
+	uint32_t pc;	// PC this op was decoded from, 0 = empty slot.
+	uint32_t ir;
+	uint32_t imm;	// Sign-extended immediate of the instruction's format (CSR number for SYSTEM).
+	uint8_t opc;	// MINIRV32_OP_*
+	uint8_t rd;		// 0 for formats that do not write back.
+	uint8_t rs1;
+	uint8_t rs2;
+	uint8_t len;	// 2 for compressed instructions, else 4.  Both halves for a fused pair.
+	uint8_t fn;		// MINIRV32_ZB_* for MINIRV32_OP_BITMANIP, length of the first half for MINIRV32_OP_FUSED_*.
+#ifdef MINIRV32_FUSION
+	uint32_t imm2;	// Result of the first half of a fused pair (offset from pc for auipc).
+#endif
+};
+
+// Ops from MINIRV32_OP_JAL on may redirect the PC or touch machine state,
+// so they end a basic block.
+enum MiniRV32IMAOpClass
+{
+	MINIRV32_OP_ILLEGAL,
+	MINIRV32_OP_LUI,
+	MINIRV32_OP_AUIPC,
+	MINIRV32_OP_LOAD,
+	MINIRV32_OP_STORE,
+	MINIRV32_OP_OPIMM,
+	MINIRV32_OP_OP,
+	MINIRV32_OP_MULDIV,
+	MINIRV32_OP_BITMANIP,
+	MINIRV32_OP_FUSED_LI,	// lui rd, hi; addi rd, rd, lo
+	MINIRV32_OP_FUSED_LA,	// auipc rd, hi; addi rd, rd, lo
+	MINIRV32_OP_FUSED_ZEXT,	// slli rd, rs, a; srli rd, rd, b
+	MINIRV32_OP_FUSED_LW,	// lui rt, hi; lw rd, lo(rt)
+	MINIRV32_OP_FENCE,
+	MINIRV32_OP_AMO,
+	MINIRV32_OP_JAL,
+	MINIRV32_OP_FUSED_CALL,	// auipc rt, hi; jalr rd, lo(rt)
+	MINIRV32_OP_JALR,
+	MINIRV32_OP_BRANCH,
+	MINIRV32_OP_SYSTEM,
+};
+
+// MINIRV32_RVC adds the C extension.  Compressed instructions are expanded
+// to their 32-bit equivalents by the decoder, so the rest of the core only
+// sees the op length.
+#ifdef MINIRV32_RVC
+	#define MINIRV32_IALIGN 2
+#else
+	#define MINIRV32_IALIGN 4
+#endif
+
+// MINIRV32_ZB adds Zba, Zbb and Zbs.  The decoder resolves each one to a
+// MINIRV32_ZB_* sub-op, the immediate forms (rori, bclri, ...) sharing the
+// register form's sub-op.  Bit counts go through the overridable
+// MINIRV32_CLZ/CTZ/CPOP, which default to the GCC builtins.
+enum MiniRV32IMAZbOp
+{
+	MINIRV32_ZB_NONE,
+	MINIRV32_ZB_SH1ADD,
+	MINIRV32_ZB_SH2ADD,
+	MINIRV32_ZB_SH3ADD,
+	MINIRV32_ZB_ANDN,
+	MINIRV32_ZB_ORN,
+	MINIRV32_ZB_XNOR,
+	MINIRV32_ZB_CLZ,
+	MINIRV32_ZB_CTZ,
+	MINIRV32_ZB_CPOP,
+	MINIRV32_ZB_MAX,
+	MINIRV32_ZB_MAXU,
+	MINIRV32_ZB_MIN,
+	MINIRV32_ZB_MINU,
+	MINIRV32_ZB_SEXTB,
+	MINIRV32_ZB_SEXTH,
+	MINIRV32_ZB_ZEXTH,
+	MINIRV32_ZB_ROL,
+	MINIRV32_ZB_ROR,
+	MINIRV32_ZB_ORCB,
+	MINIRV32_ZB_REV8,
+	MINIRV32_ZB_BCLR,
+	MINIRV32_ZB_BEXT,
+	MINIRV32_ZB_BINV,
+	MINIRV32_ZB_BSET,
+};
+
+#ifndef MINIRV32_CLZ
+	#define MINIRV32_CLZ( x ) __builtin_clz( x )
+#endif
+#ifndef MINIRV32_CTZ
+	#define MINIRV32_CTZ( x ) __builtin_ctz( x )
+#endif
+#ifndef MINIRV32_CPOP
+	#define MINIRV32_CPOP( x ) __builtin_popcount( x )
+#endif
+
+// MINIRV32_BLOCK_ENGINE runs straight-line runs of predecoded ops back to
+// back: the PC bounds check, the count check and MINIRV32_POSTEXEC only
+// happen at basic block boundaries, or after a store that ends the slice.  MINIRV32_COMPUTED_GOTO (GCC/Clang)
+// dispatches through a label table instead of the switch; whether that wins
+// depends on the compiler and core, so benchmark both.
+#ifdef MINIRV32_BLOCK_ENGINE
+	#ifndef MINIRV32_PREDECODE
+		#define MINIRV32_PREDECODE
+	#endif
+#endif
+
+// MINIRV32_FUSION folds common compiler-emitted pairs (see the
+// MINIRV32_OP_FUSED_* classes) into one predecoded op that is dispatched
+// once but still retires as two instructions.  Pairs are only formed when
+// an op is put in the predecode table, so this implies MINIRV32_PREDECODE.
+// MiniRV32IMAFusedPairs counts the pairs executed.
+#ifdef MINIRV32_FUSION
+	#ifndef MINIRV32_PREDECODE
+		#define MINIRV32_PREDECODE
+	#endif
+	#define MINIRV32_MAX_OP_LEN 8
+#else
+	#define MINIRV32_MAX_OP_LEN 4
+#endif
+
+#ifdef MINIRV32_COMPUTED_GOTO
+	#define MINIRV32_OPCASE( x ) case MINIRV32_OP_##x: handle_##x
+#else
+	#define MINIRV32_OPCASE( x ) case MINIRV32_OP_##x
+#endif
+
+#ifdef MINIRV32_PREDECODE
+	#ifndef MINIRV32_PREDECODE_ENTRIES
+		#define MINIRV32_PREDECODE_ENTRIES 256
+	#endif
+	#if MINIRV32_PREDECODE_ENTRIES & ( MINIRV32_PREDECODE_ENTRIES - 1 )
+		#error MINIRV32_PREDECODE_ENTRIES must be a power of 2
+	#endif
+#endif
+
 #ifndef MINIRV32_STEPPROTO
 MINIRV32_DECORATE int32_t MiniRV32IMAStep( struct MiniRV32IMAState * state, uint8_t * image, uint32_t vProcAddress, uint32_t elapsedUs, int count );
 #endif
@@ -111,6 +278,326 @@ MINIRV32_DECORATE int32_t MiniRV32IMAStep( struct MiniRV32IMAState * state, uint
 #define REGSET( x, val ) { state->regs[x] = val; }
 #endif
 
+#ifdef MINIRV32_RVC
+#define RV_R( f7, rs2, rs1, f3, rd, opc ) ( ( (uint32_t)(f7) << 25 ) | ( (rs2) << 20 ) | ( (rs1) << 15 ) | ( (f3) << 12 ) | ( (rd) << 7 ) | (opc) )
+#define RV_I( imm, rs1, f3, rd, opc ) ( ( ( (uint32_t)(imm) & 0xfff ) << 20 ) | ( (rs1) << 15 ) | ( (f3) << 12 ) | ( (rd) << 7 ) | (opc) )
+#define RV_S( imm, rs2, rs1, f3 ) ( ( ( ( (uint32_t)(imm) >> 5 ) & 0x7f ) << 25 ) | ( (rs2) << 20 ) | ( (rs1) << 15 ) | ( (f3) << 12 ) | ( ( (imm) & 0x1f ) << 7 ) | 0x23 )
+#define RV_B( imm, rs1, f3 ) ( ( ( ( (uint32_t)(imm) >> 12 ) & 1 ) << 31 ) | ( ( ( (imm) >> 5 ) & 0x3f ) << 25 ) | ( (rs1) << 15 ) | ( (f3) << 12 ) | \
+	( ( ( (imm) >> 1 ) & 0xf ) << 8 ) | ( ( ( (imm) >> 11 ) & 1 ) << 7 ) | 0x63 )
+#define RV_J( imm, rd ) ( ( ( ( (uint32_t)(imm) >> 20 ) & 1 ) << 31 ) | ( ( ( (imm) >> 1 ) & 0x3ff ) << 21 ) | ( ( ( (imm) >> 11 ) & 1 ) << 20 ) | \
+	( ( ( (imm) >> 12 ) & 0xff ) << 12 ) | ( (rd) << 7 ) | 0x6f )
+
+// Expand a 16-bit RVC instruction to the RV32I instruction it stands for, 0 if it is illegal.
+static inline uint32_t MiniRV32IMAExpandCompressed( uint32_t c )
+{
+	uint32_t rd = (c >> 7) & 0x1f;			// rd/rs1
+	uint32_t rs2 = (c >> 2) & 0x1f;
+	uint32_t rdp = 8 + ((c >> 2) & 7);		// rd'/rs2'
+	uint32_t rs1p = 8 + ((c >> 7) & 7);		// rd'/rs1'
+	uint32_t imm6 = ((c >> 7) & 0x20) | ((c >> 2) & 0x1f);
+	uint32_t simm6 = imm6 | (( imm6 & 0x20 )?0xffffffc0:0);
+	uint32_t jimm = ((c >> 1) & 0x800) | ((c >> 7) & 0x10) | ((c >> 1) & 0x300) | ((c << 2) & 0x400) |
+		((c >> 1) & 0x40) | ((c << 1) & 0x80) | ((c >> 2) & 0xe) | ((c << 3) & 0x20);
+	uint32_t bimm = ((c >> 4) & 0x100) | ((c >> 7) & 0x18) | ((c << 1) & 0xc0) | ((c >> 2) & 6) | ((c << 3) & 0x20);
+	if( jimm & 0x800 ) jimm |= 0xfffff000;
+	if( bimm & 0x100 ) bimm |= 0xfffffe00;
+
+	switch( ( (c >> 11) & 0x1c ) | ( c & 3 ) ) // funct3, quadrant
+	{
+		case 0x00: // C.ADDI4SPN
+		{
+			uint32_t nzuimm = ((c >> 7) & 0x30) | ((c >> 1) & 0x3c0) | ((c >> 4) & 4) | ((c >> 2) & 8);
+			return nzuimm ? RV_I( nzuimm, 2, 0, rdp, 0x13 ) : 0;
+		}
+		case 0x08: // C.LW
+		case 0x18: // C.SW
+		{
+			uint32_t uimm = ((c >> 7) & 0x38) | ((c >> 4) & 4) | ((c << 1) & 0x40);
+			return ( c & 0x8000 ) ? RV_S( uimm, rdp, rs1p, 2 ) : RV_I( uimm, rs1p, 2, rdp, 0x03 );
+		}
+		case 0x01: return RV_I( simm6, rd, 0, rd, 0x13 ); // C.ADDI, C.NOP
+		case 0x05: return RV_J( jimm, 1 ); // C.JAL
+		case 0x09: return RV_I( simm6, 0, 0, rd, 0x13 ); // C.LI
+		case 0x0d:
+			if( rd == 2 ) // C.ADDI16SP
+			{
+				uint32_t nzimm = ((c >> 3) & 0x200) | ((c >> 2) & 0x10) | ((c << 1) & 0x40) | ((c << 4) & 0x180) | ((c << 3) & 0x20);
+				if( nzimm & 0x200 ) nzimm |= 0xfffffc00;
+				return nzimm ? RV_I( nzimm, 2, 0, 2, 0x13 ) : 0;
+			}
+			return imm6 ? ( ( simm6 << 12 ) | ( rd << 7 ) | 0x37 ) : 0; // C.LUI
+		case 0x11:
+			switch( (c >> 10) & 3 )
+			{
+				case 0: return ( c & 0x1000 ) ? 0 : RV_I( imm6, rs1p, 5, rs1p, 0x13 ); // C.SRLI
+				case 1: return ( c & 0x1000 ) ? 0 : RV_I( 0x400 | imm6, rs1p, 5, rs1p, 0x13 ); // C.SRAI
+				case 2: return RV_I( simm6, rs1p, 7, rs1p, 0x13 ); // C.ANDI
+				default:
+				{
+					static const uint8_t funct3[4] = { 0, 4, 6, 7 }; // C.SUB, C.XOR, C.OR, C.AND
+					uint32_t f = (c >> 5) & 3;
+					return ( c & 0x1000 ) ? 0 : RV_R( f ? 0 : 0x20, rdp, rs1p, funct3[f], rs1p, 0x33 );
+				}
+			}
+		case 0x15: return RV_J( jimm, 0 ); // C.J
+		case 0x19: return RV_B( bimm, rs1p, 0 ); // C.BEQZ
+		case 0x1d: return RV_B( bimm, rs1p, 1 ); // C.BNEZ
+		case 0x02: return ( c & 0x1000 ) ? 0 : RV_I( imm6, rd, 1, rd, 0x13 ); // C.SLLI
+		case 0x0a: // C.LWSP
+		{
+			uint32_t uimm = ((c >> 7) & 0x20) | ((c >> 2) & 0x1c) | ((c << 4) & 0xc0);
+			return rd ? RV_I( uimm, 2, 2, rd, 0x03 ) : 0;
+		}
+		case 0x12:
+			if( !( c & 0x1000 ) )
+			{
+				if( rs2 ) return RV_R( 0, rs2, 0, 0, rd, 0x33 ); // C.MV
+				return rd ? RV_I( 0, rd, 0, 0, 0x67 ) : 0; // C.JR
+			}
+			if( rs2 ) return RV_R( 0, rs2, rd, 0, rd, 0x33 ); // C.ADD
+			return rd ? RV_I( 0, rd, 0, 1, 0x67 ) : 0x00100073; // C.JALR, C.EBREAK
+		case 0x1a: // C.SWSP
+		{
+			uint32_t uimm = ((c >> 7) & 0x3c) | ((c >> 1) & 0xc0);
+			return RV_S( uimm, rs2, 2, 2 );
+		}
+		default: return 0; // Floating point loads/stores and reserved encodings.
+	}
+}
+
+#undef RV_R
+#undef RV_I
+#undef RV_S
+#undef RV_B
+#undef RV_J
+#endif
+
+#ifdef MINIRV32_ZB
+// Returns the MINIRV32_ZB_* sub-op of an OP (0b0110011) or OP-IMM (0b0010011)
+// instruction, or MINIRV32_ZB_NONE if it is a base/M instruction.
+static inline uint8_t MiniRV32IMADecodeZb( uint32_t ir )
+{
+	uint32_t funct3 = ( ir >> 12 ) & 7;
+	uint32_t funct7 = ir >> 25;
+	uint32_t rs2 = ( ir >> 20 ) & 0x1f;
+
+	if( ( ir & 0x7f ) == 0x13 )
+	{
+		if( funct3 == 1 )
+		{
+			switch( funct7 )
+			{
+				case 0x30:
+					switch( rs2 )
+					{
+						case 0: return MINIRV32_ZB_CLZ;
+						case 1: return MINIRV32_ZB_CTZ;
+						case 2: return MINIRV32_ZB_CPOP;
+						case 4: return MINIRV32_ZB_SEXTB;
+						case 5: return MINIRV32_ZB_SEXTH;
+					}
+					break;
+				case 0x24: return MINIRV32_ZB_BCLR; // BCLRI
+				case 0x14: return MINIRV32_ZB_BSET; // BSETI
+				case 0x34: return MINIRV32_ZB_BINV; // BINVI
+			}
+		}
+		else if( funct3 == 5 )
+		{
+			if( ( ir >> 20 ) == 0x287 ) return MINIRV32_ZB_ORCB;
+			if( ( ir >> 20 ) == 0x698 ) return MINIRV32_ZB_REV8;
+			if( funct7 == 0x30 ) return MINIRV32_ZB_ROR; // RORI
+			if( funct7 == 0x24 ) return MINIRV32_ZB_BEXT; // BEXTI
+		}
+		return MINIRV32_ZB_NONE;
+	}
+
+	switch( ( funct7 << 3 ) | funct3 )
+	{
+		case ( 0x10 << 3 ) | 2: return MINIRV32_ZB_SH1ADD;
+		case ( 0x10 << 3 ) | 4: return MINIRV32_ZB_SH2ADD;
+		case ( 0x10 << 3 ) | 6: return MINIRV32_ZB_SH3ADD;
+		case ( 0x20 << 3 ) | 7: return MINIRV32_ZB_ANDN;
+		case ( 0x20 << 3 ) | 6: return MINIRV32_ZB_ORN;
+		case ( 0x20 << 3 ) | 4: return MINIRV32_ZB_XNOR;
+		case ( 0x05 << 3 ) | 4: return MINIRV32_ZB_MIN;
+		case ( 0x05 << 3 ) | 5: return MINIRV32_ZB_MINU;
+		case ( 0x05 << 3 ) | 6: return MINIRV32_ZB_MAX;
+		case ( 0x05 << 3 ) | 7: return MINIRV32_ZB_MAXU;
+		case ( 0x04 << 3 ) | 4: return rs2 ? MINIRV32_ZB_NONE : MINIRV32_ZB_ZEXTH;
+		case ( 0x30 << 3 ) | 1: return MINIRV32_ZB_ROL;
+		case ( 0x30 << 3 ) | 5: return MINIRV32_ZB_ROR;
+		case ( 0x24 << 3 ) | 1: return MINIRV32_ZB_BCLR;
+		case ( 0x24 << 3 ) | 5: return MINIRV32_ZB_BEXT;
+		case ( 0x14 << 3 ) | 1: return MINIRV32_ZB_BSET;
+		case ( 0x34 << 3 ) | 1: return MINIRV32_ZB_BINV;
+	}
+	return MINIRV32_ZB_NONE;
+}
+#endif
+
+static inline void MiniRV32IMADecode( struct MiniRV32IMAOp * op, uint32_t ir )
+{
+	op->len = 4;
+#ifdef MINIRV32_RVC
+	if( ( ir & 3 ) != 3 )
+	{
+		op->len = 2;
+		ir = MiniRV32IMAExpandCompressed( ir & 0xffff );
+	}
+#endif
+	op->ir = ir;
+	op->rd = (ir >> 7) & 0x1f;
+	op->rs1 = (ir >> 15) & 0x1f;
+	op->rs2 = (ir >> 20) & 0x1f;
+	op->imm = ( ir >> 20 ) | (( ir & 0x80000000 )?0xfffff000:0); // I-type, the most common.
+
+	switch( ir & 0x7f )
+	{
+		case 0x37: op->opc = MINIRV32_OP_LUI; op->imm = ir & 0xfffff000; break;
+		case 0x17: op->opc = MINIRV32_OP_AUIPC; op->imm = ir & 0xfffff000; break;
+		case 0x6F:
+		{
+			int32_t reladdy = ((ir & 0x80000000)>>11) | ((ir & 0x7fe00000)>>20) | ((ir & 0x00100000)>>9) | ((ir&0x000ff000));
+			if( reladdy & 0x00100000 ) reladdy |= 0xffe00000; // Sign extension.
+			op->opc = MINIRV32_OP_JAL;
+			op->imm = reladdy;
+			break;
+		}
+		case 0x67: op->opc = MINIRV32_OP_JALR; break;
+		case 0x63:
+		{
+			uint32_t immm4 = ((ir & 0xf00)>>7) | ((ir & 0x7e000000)>>20) | ((ir & 0x80) << 4) | ((ir >> 31)<<12);
+			if( immm4 & 0x1000 ) immm4 |= 0xffffe000;
+			op->opc = MINIRV32_OP_BRANCH;
+			op->imm = immm4;
+			op->rd = 0;
+			break;
+		}
+		case 0x03: op->opc = MINIRV32_OP_LOAD; break;
+		case 0x23:
+		{
+			uint32_t addy = ( ( ir >> 7 ) & 0x1f ) | ( ( ir & 0xfe000000 ) >> 20 );
+			if( addy & 0x800 ) addy |= 0xfffff000;
+			op->opc = MINIRV32_OP_STORE;
+			op->imm = addy;
+			op->rd = 0;
+			break;
+		}
+		case 0x13: op->opc = MINIRV32_OP_OPIMM; break;
+		case 0x33: op->opc = ( ir & 0x02000000 ) ? MINIRV32_OP_MULDIV : MINIRV32_OP_OP; break;
+		case 0x0f: op->opc = MINIRV32_OP_FENCE; op->rd = 0; break;
+		case 0x73: op->opc = MINIRV32_OP_SYSTEM; op->imm = ir >> 20; break;
+		case 0x2f: op->opc = MINIRV32_OP_AMO; break;
+		default: op->opc = MINIRV32_OP_ILLEGAL; break;
+	}
+#ifdef MINIRV32_ZB
+	op->fn = ( op->opc >= MINIRV32_OP_OPIMM && op->opc <= MINIRV32_OP_MULDIV ) ? MiniRV32IMADecodeZb( ir ) : MINIRV32_ZB_NONE;
+	if( op->fn != MINIRV32_ZB_NONE )
+		op->opc = MINIRV32_OP_BITMANIP;
+#endif
+}
+
+#ifdef MINIRV32_PREDECODE
+MINIRV32_DECORATE struct MiniRV32IMAOp MiniRV32IMAPredecode[MINIRV32_PREDECODE_ENTRIES];
+
+static inline struct MiniRV32IMAOp * MiniRV32IMAPredecodeSlot( uint32_t ofs )
+{
+	return &MiniRV32IMAPredecode[( ofs / MINIRV32_IALIGN ) & ( MINIRV32_PREDECODE_ENTRIES - 1 )];
+}
+
+// Must be called whenever RAM changes behind the core's back (image load, snapshot restore).
+MINIRV32_DECORATE void MiniRV32IMAPredecodeFlush( void )
+{
+	for( int i = 0; i < MINIRV32_PREDECODE_ENTRIES; i++ )
+		MiniRV32IMAPredecode[i].pc = 0;
+}
+
+// Drop any op decoded from the image range [ofs, ofs+len).
+MINIRV32_DECORATE void MiniRV32IMAPredecodeInvalidate( uint32_t ofs, uint32_t len )
+{
+	if( len >= MINIRV32_PREDECODE_ENTRIES * MINIRV32_IALIGN )
+	{
+		MiniRV32IMAPredecodeFlush();
+		return;
+	}
+	// Ops starting just before ofs (a 4-byte op with RVC, or a fused pair) overlap it too.
+	uint32_t a = ofs & ~( MINIRV32_IALIGN - 1 );
+	if( a >= MINIRV32_MAX_OP_LEN - MINIRV32_IALIGN )
+		a -= MINIRV32_MAX_OP_LEN - MINIRV32_IALIGN;
+	else
+		a = 0;
+	for( ; a < ofs + len; a += MINIRV32_IALIGN )
+	{
+		struct MiniRV32IMAOp * op = MiniRV32IMAPredecodeSlot( a );
+		if( op->pc == a + MINIRV32_RAM_IMAGE_OFFSET )
+			op->pc = 0;
+	}
+}
+
+#ifdef MINIRV32_FUSION
+MINIRV32_DECORATE uint64_t MiniRV32IMAFusedPairs;
+
+// Try to merge the freshly decoded op at image offset ofs with the one that
+// follows it.  Only pairs whose first half cannot trap are formed, and the
+// first half of a pair must not write x0.
+static void MiniRV32IMAFuse( struct MiniRV32IMAOp * op, uint32_t ofs )
+{
+	struct MiniRV32IMAOp second;
+	uint32_t f3;
+	uint8_t opc = MINIRV32_OP_ILLEGAL;
+
+	if( !op->rd || ofs + op->len + 4 > MINI_RV32_RAM_SIZE )
+		return;
+	if( op->opc != MINIRV32_OP_LUI && op->opc != MINIRV32_OP_AUIPC &&
+		!( op->opc == MINIRV32_OP_OPIMM && ( op->ir & 0xfe007000 ) == 0x1000 ) ) // SLLI
+		return;
+
+	MiniRV32IMADecode( &second, MINIRV32_FETCH_INSN( ofs + op->len ) );
+	if( second.rs1 != op->rd )
+		return;
+	f3 = ( second.ir >> 12 ) & 7;
+
+	switch( op->opc )
+	{
+		case MINIRV32_OP_LUI:
+			if( second.opc == MINIRV32_OP_OPIMM && f3 == 0 && second.rd == op->rd )
+				opc = MINIRV32_OP_FUSED_LI;
+			else if( second.opc == MINIRV32_OP_LOAD && f3 == 2 )
+				opc = MINIRV32_OP_FUSED_LW;
+			break;
+		case MINIRV32_OP_AUIPC:
+			if( second.opc == MINIRV32_OP_OPIMM && f3 == 0 && second.rd == op->rd )
+				opc = MINIRV32_OP_FUSED_LA;
+			else if( second.opc == MINIRV32_OP_JALR && f3 == 0 )
+				opc = MINIRV32_OP_FUSED_CALL;
+			break;
+		default: // SLLI
+			if( second.opc == MINIRV32_OP_OPIMM && ( second.ir & 0xfe007000 ) == 0x5000 && second.rd == op->rd ) // SRLI
+			{
+				op->imm = op->rs2;
+				opc = MINIRV32_OP_FUSED_ZEXT;
+			}
+			break;
+	}
+	if( opc == MINIRV32_OP_ILLEGAL )
+		return;
+
+	// The first half's rd moves to rs1 (unless it is a shift, where rs1 is
+	// the shifted register), the second half provides ir, imm and rd.
+	op->imm2 = op->imm;
+	if( opc != MINIRV32_OP_FUSED_ZEXT )
+		op->rs1 = op->rd;
+	op->opc = opc;
+	op->fn = op->len;
+	op->len += second.len;
+	op->ir = second.ir;
+	op->imm = second.imm;
+	op->rd = second.rd;
+}
+#endif
+#endif
+
 #ifndef MINIRV32_STEPPROTO
 MINIRV32_DECORATE int32_t MiniRV32IMAStep( struct MiniRV32IMAState * state, uint8_t * image, uint32_t vProcAddress, uint32_t elapsedUs, int count )
 #else
@@ -139,6 +626,20 @@ MINIRV32_STEPPROTO
 	uint32_t pc = CSR( pc );
 	uint32_t cycle = CSR( cyclel );
 
+#ifdef MINIRV32_COMPUTED_GOTO
+	static const void * const handlers[] = {
+		[MINIRV32_OP_ILLEGAL] = &&handle_ILLEGAL, [MINIRV32_OP_LUI] = &&handle_LUI, [MINIRV32_OP_AUIPC] = &&handle_AUIPC,
+		[MINIRV32_OP_LOAD] = &&handle_LOAD, [MINIRV32_OP_STORE] = &&handle_STORE, [MINIRV32_OP_OPIMM] = &&handle_OPIMM,
+		[MINIRV32_OP_OP] = &&handle_OP, [MINIRV32_OP_MULDIV] = &&handle_MULDIV, [MINIRV32_OP_BITMANIP] = &&handle_BITMANIP, [MINIRV32_OP_FENCE] = &&handle_FENCE,
+		[MINIRV32_OP_AMO] = &&handle_AMO, [MINIRV32_OP_JAL] = &&handle_JAL, [MINIRV32_OP_JALR] = &&handle_JALR,
+		[MINIRV32_OP_BRANCH] = &&handle_BRANCH, [MINIRV32_OP_SYSTEM] = &&handle_SYSTEM,
+#ifdef MINIRV32_FUSION
+		[MINIRV32_OP_FUSED_LI] = &&handle_FUSED_LI, [MINIRV32_OP_FUSED_LA] = &&handle_FUSED_LA, [MINIRV32_OP_FUSED_ZEXT] = &&handle_FUSED_ZEXT,
+		[MINIRV32_OP_FUSED_LW] = &&handle_FUSED_LW, [MINIRV32_OP_FUSED_CALL] = &&handle_FUSED_CALL,
+#endif
+	};
+#endif
+
 	if( ( CSR( mip ) & (1<<7) ) && ( CSR( mie ) & (1<<7) /*mtie*/ ) && ( CSR( mstatus ) & 0x8 /*mie*/) )
 	{
 		// Timer interrupt.
@@ -149,7 +650,20 @@ MINIRV32_STEPPROTO
 	for( int icount = 0; icount < count; icount++ )
 	{
 		uint32_t ir = 0;
+		uint32_t ilen = 4;
 		rval = 0;
+#ifdef MINIRV32_RUN_TRANSLATED
+		// Optional binary translator hook: runs native code for the block at
+		// pc, if there is any, and returns how many instructions it retired.
+		// pc is left at the next block boundary.
+		int translated = MINIRV32_RUN_TRANSLATED( state, &pc );
+		if( translated )
+		{
+			cycle += translated;
+			icount += translated - 1;
+			continue;
+		}
+#endif
 		cycle++;
 		uint32_t ofs_pc = pc - MINIRV32_RAM_IMAGE_OFFSET;
 
@@ -158,48 +672,100 @@ MINIRV32_STEPPROTO
 			trap = 1 + 1;  // Handle access violation on instruction read.
 			break;
 		}
-		else if( ofs_pc & 3 )
+		else if( ofs_pc & ( MINIRV32_IALIGN - 1 ) )
 		{
 			trap = 1 + 0;  //Handle PC-misaligned access
 			break;
 		}
+		else if( MINIRV32_FETCH_PAST_END( ofs_pc ) )
+		{
+			trap = 1 + 1;  // Second half of the instruction is outside RAM.
+			break;
+		}
 		else
 		{
-			ir = MINIRV32_LOAD4( ofs_pc );
-			uint32_t rdid = (ir >> 7) & 0x1f;
+#ifdef MINIRV32_PREDECODE
+			struct MiniRV32IMAOp * op = MiniRV32IMAPredecodeSlot( ofs_pc );
+			if( op->pc != pc )
+			{
+				MiniRV32IMADecode( op, MINIRV32_FETCH_INSN( ofs_pc ) );
+#ifdef MINIRV32_FUSION
+				MiniRV32IMAFuse( op, ofs_pc );
+#endif
+				op->pc = pc;
+			}
+#else
+			struct MiniRV32IMAOp opbuf;
+			struct MiniRV32IMAOp * op = &opbuf;
+			MiniRV32IMADecode( op, MINIRV32_FETCH_INSN( ofs_pc ) );
+#endif
+#ifdef MINIRV32_BLOCK_ENGINE
+		block_next:
+#endif
+			ir = op->ir;
+			ilen = op->len;
+			uint32_t rdid = op->rd;
 
-			switch( ir & 0x7f )
+#ifdef MINIRV32_COMPUTED_GOTO
+			goto *handlers[op->opc];
+#endif
+			switch( op->opc )
 			{
-				case 0x37: // LUI (0b0110111)
-					rval = ( ir & 0xfffff000 );
+				MINIRV32_OPCASE( LUI ): // LUI (0b0110111)
+					rval = op->imm;
 					break;
-				case 0x17: // AUIPC (0b0010111)
-					rval = pc + ( ir & 0xfffff000 );
+				MINIRV32_OPCASE( AUIPC ): // AUIPC (0b0010111)
+					rval = pc + op->imm;
 					break;
-				case 0x6F: // JAL (0b1101111)
-				{
-					int32_t reladdy = ((ir & 0x80000000)>>11) | ((ir & 0x7fe00000)>>20) | ((ir & 0x00100000)>>9) | ((ir&0x000ff000));
-					if( reladdy & 0x00100000 ) reladdy |= 0xffe00000; // Sign extension.
-					rval = pc + 4;
-					pc = pc + reladdy - 4;
+#ifdef MINIRV32_FUSION
+				// Fused pairs retire two instructions; see MiniRV32IMAFuse.
+				MINIRV32_OPCASE( FUSED_LI ):
+					rval = op->imm2 + op->imm;
+					cycle++; icount++; MiniRV32IMAFusedPairs++;
 					break;
-				}
-				case 0x67: // JALR (0b1100111)
+				MINIRV32_OPCASE( FUSED_LA ):
+					rval = pc + op->imm2 + op->imm;
+					cycle++; icount++; MiniRV32IMAFusedPairs++;
+					break;
+				MINIRV32_OPCASE( FUSED_ZEXT ):
+					rval = ( REG( op->rs1 ) << ( op->imm2 & 0x1F ) ) >> ( op->imm & 0x1F );
+					cycle++; icount++; MiniRV32IMAFusedPairs++;
+					break;
+				MINIRV32_OPCASE( FUSED_CALL ):
+					REGSET( op->rs1, pc + op->imm2 );
+					rval = pc + op->len;
+					pc = ( ( pc + op->imm2 + op->imm ) & ~1 ) - op->len;
+					cycle++; icount++; MiniRV32IMAFusedPairs++;
+					break;
+				MINIRV32_OPCASE( FUSED_LW ):
 				{
-					uint32_t imm = ir >> 20;
-					int32_t imm_se = imm | (( imm & 0x800 )?0xfffff000:0);
-					rval = pc + 4;
-					pc = ( (REG( (ir >> 15) & 0x1f ) + imm_se) & ~1) - 4;
+					uint32_t addy = op->imm2 + op->imm - MINIRV32_RAM_IMAGE_OFFSET;
+					REGSET( op->rs1, op->imm2 );
+					if( addy >= MINI_RV32_RAM_SIZE-3 )
+					{
+						// MMIO or a fault: retire the lui alone, the lw then runs (and traps) as itself.
+						rdid = 0;
+						ilen = op->fn;
+						break;
+					}
+					rval = MINIRV32_LOAD4( addy );
+					cycle++; icount++; MiniRV32IMAFusedPairs++;
 					break;
 				}
-				case 0x63: // Branch (0b1100011)
+#endif
+				MINIRV32_OPCASE( JAL ): // JAL (0b1101111)
+					rval = pc + op->len;
+					pc = pc + op->imm - op->len;
+					break;
+				MINIRV32_OPCASE( JALR ): // JALR (0b1100111)
+					rval = pc + op->len;
+					pc = ( (REG( op->rs1 ) + op->imm) & ~1) - op->len;
+					break;
+				MINIRV32_OPCASE( BRANCH ): // Branch (0b1100011)
 				{
-					uint32_t immm4 = ((ir & 0xf00)>>7) | ((ir & 0x7e000000)>>20) | ((ir & 0x80) << 4) | ((ir >> 31)<<12);
-					if( immm4 & 0x1000 ) immm4 |= 0xffffe000;
-					int32_t rs1 = REG((ir >> 15) & 0x1f);
-					int32_t rs2 = REG((ir >> 20) & 0x1f);
-					immm4 = pc + immm4 - 4;
-					rdid = 0;
+					int32_t rs1 = REG( op->rs1 );
+					int32_t rs2 = REG( op->rs2 );
+					uint32_t immm4 = pc + op->imm - op->len;
 					switch( ( ir >> 12 ) & 0x7 )
 					{
 						// BEQ, BNE, BLT, BGE, BLTU, BGEU
@@ -213,12 +779,9 @@ MINIRV32_STEPPROTO
 					}
 					break;
 				}
-				case 0x03: // Load (0b0000011)
+				MINIRV32_OPCASE( LOAD ): // Load (0b0000011)
 				{
-					uint32_t rs1 = REG((ir >> 15) & 0x1f);
-					uint32_t imm = ir >> 20;
-					int32_t imm_se = imm | (( imm & 0x800 )?0xfffff000:0);
-					uint32_t rsval = rs1 + imm_se;
+					uint32_t rsval = REG( op->rs1 ) + op->imm;
 
 					rsval -= MINIRV32_RAM_IMAGE_OFFSET;
 					if( rsval >= MINI_RV32_RAM_SIZE-3 )
@@ -226,12 +789,16 @@ MINIRV32_STEPPROTO
 						rsval += MINIRV32_RAM_IMAGE_OFFSET;
 						if( rsval >= 0x10000000 && rsval < 0x12000000 )  // UART, CLNT
 						{
+#ifdef MINIRV32_CUSTOM_MMIO
+							rval = MINIRV32_MMIO_LOAD( rsval );
+#else
 							if( rsval == 0x1100bffc ) // https://chromitem-soc.readthedocs.io/en/latest/clint.html
 								rval = CSR( timerh );
 							else if( rsval == 0x1100bff8 )
 								rval = CSR( timerl );
 							else
 								MINIRV32_HANDLE_MEM_LOAD_CONTROL( rsval, rval );
+#endif
 						}
 						else
 						{
@@ -254,32 +821,45 @@ MINIRV32_STEPPROTO
 					}
 					break;
 				}
-				case 0x23: // Store 0b0100011
+				MINIRV32_OPCASE( STORE ): // Store 0b0100011
 				{
-					uint32_t rs1 = REG((ir >> 15) & 0x1f);
-					uint32_t rs2 = REG((ir >> 20) & 0x1f);
-					uint32_t addy = ( ( ir >> 7 ) & 0x1f ) | ( ( ir & 0xfe000000 ) >> 20 );
-					if( addy & 0x800 ) addy |= 0xfffff000;
-					addy += rs1 - MINIRV32_RAM_IMAGE_OFFSET;
-					rdid = 0;
+					uint32_t rs2 = REG( op->rs2 );
+					uint32_t addy = REG( op->rs1 ) + op->imm - MINIRV32_RAM_IMAGE_OFFSET;
 
 					if( addy >= MINI_RV32_RAM_SIZE-3 )
 					{
 						addy += MINIRV32_RAM_IMAGE_OFFSET;
 						if( addy >= 0x10000000 && addy < 0x12000000 )
 						{
+#ifdef MINIRV32_CUSTOM_MMIO
+							uint32_t code = MINIRV32_MMIO_STORE( addy, rs2 );
+							if( code == MINIRV32_MMIO_YIELD )
+								count = 0;
+							else if( code )
+							{
+								SETCSR( pc, pc + op->len );
+								return code;
+							}
+#else
 							// Should be stuff like SYSCON, 8250, CLNT
 							if( addy == 0x11004004 ) //CLNT
+							{
 								CSR( timermatchh ) = rs2;
+								count = 0; // End the slice so the caller sees the new deadline.
+							}
 							else if( addy == 0x11004000 ) //CLNT
+							{
 								CSR( timermatchl ) = rs2;
+								count = 0;
+							}
 							else if( addy == 0x11100000 ) //SYSCON (reboot, poweroff, etc.)
 							{
-								SETCSR( pc, pc + 4 );
+								SETCSR( pc, pc + op->len );
 								return rs2; // NOTE: PC will be PC of Syscon.
 							}
 							else
 								MINIRV32_HANDLE_MEM_STORE_CONTROL( addy, rs2 );
+#endif
 						}
 						else
 						{
@@ -297,62 +877,103 @@ MINIRV32_STEPPROTO
 							case 2: MINIRV32_STORE4( addy, rs2 ); break;
 							default: trap = (2+1);
 						}
+#ifdef MINIRV32_PREDECODE
+						MiniRV32IMAPredecodeInvalidate( addy, 4 );
+#endif
+						MINIRV32_CODE_WRITTEN( addy, 4 );
 					}
 					break;
 				}
-				case 0x13: // Op-immediate 0b0010011
-				case 0x33: // Op           0b0110011
+				MINIRV32_OPCASE( MULDIV ): // RV32M 0b0110011, funct7 = 1
 				{
-					uint32_t imm = ir >> 20;
-					imm = imm | (( imm & 0x800 )?0xfffff000:0);
-					uint32_t rs1 = REG((ir >> 15) & 0x1f);
-					uint32_t is_reg = !!( ir & 0x20 );
-					uint32_t rs2 = is_reg ? REG(imm & 0x1f) : imm;
-
-					if( is_reg && ( ir & 0x02000000 ) )
+					uint32_t rs1 = REG( op->rs1 );
+					uint32_t rs2 = REG( op->rs2 );
+					switch( (ir>>12)&7 )
 					{
-						switch( (ir>>12)&7 ) //0x02000000 = RV32M
-						{
-							case 0: rval = rs1 * rs2; break; // MUL
+						case 0: rval = rs1 * rs2; break; // MUL
 #ifndef CUSTOM_MULH // If compiling on a system that doesn't natively, or via libgcc support 64-bit math.
-							case 1: rval = ((int64_t)((int32_t)rs1) * (int64_t)((int32_t)rs2)) >> 32; break; // MULH
-							case 2: rval = ((int64_t)((int32_t)rs1) * (uint64_t)rs2) >> 32; break; // MULHSU
-							case 3: rval = ((uint64_t)rs1 * (uint64_t)rs2) >> 32; break; // MULHU
+						case 1: rval = ((int64_t)((int32_t)rs1) * (int64_t)((int32_t)rs2)) >> 32; break; // MULH
+						case 2: rval = ((int64_t)((int32_t)rs1) * (uint64_t)rs2) >> 32; break; // MULHSU
+						case 3: rval = ((uint64_t)rs1 * (uint64_t)rs2) >> 32; break; // MULHU
 #else
-							CUSTOM_MULH
+						CUSTOM_MULH
 #endif
-							case 4: if( rs2 == 0 ) rval = -1; else rval = ((int32_t)rs1 == INT32_MIN && (int32_t)rs2 == -1) ? rs1 : ((int32_t)rs1 / (int32_t)rs2); break; // DIV
-							case 5: if( rs2 == 0 ) rval = 0xffffffff; else rval = rs1 / rs2; break; // DIVU
-							case 6: if( rs2 == 0 ) rval = rs1; else rval = ((int32_t)rs1 == INT32_MIN && (int32_t)rs2 == -1) ? 0 : ((uint32_t)((int32_t)rs1 % (int32_t)rs2)); break; // REM
-							case 7: if( rs2 == 0 ) rval = rs1; else rval = rs1 % rs2; break; // REMU
-						}
+						case 4: if( rs2 == 0 ) rval = -1; else rval = ((int32_t)rs1 == INT32_MIN && (int32_t)rs2 == -1) ? rs1 : ((int32_t)rs1 / (int32_t)rs2); break; // DIV
+						case 5: if( rs2 == 0 ) rval = 0xffffffff; else rval = rs1 / rs2; break; // DIVU
+						case 6: if( rs2 == 0 ) rval = rs1; else rval = ((int32_t)rs1 == INT32_MIN && (int32_t)rs2 == -1) ? 0 : ((uint32_t)((int32_t)rs1 % (int32_t)rs2)); break; // REM
+						case 7: if( rs2 == 0 ) rval = rs1; else rval = rs1 % rs2; break; // REMU
 					}
-					else
+					break;
+				}
+				MINIRV32_OPCASE( OPIMM ): // Op-immediate 0b0010011
+				MINIRV32_OPCASE( OP ):    // Op           0b0110011
+				{
+					uint32_t rs1 = REG( op->rs1 );
+					uint32_t is_reg = op->opc == MINIRV32_OP_OP;
+					uint32_t rs2 = is_reg ? REG( op->rs2 ) : op->imm;
+
+					switch( (ir>>12)&7 ) // These could be either op-immediate or op commands.  Be careful.
+					{
+						case 0: rval = (is_reg && (ir & 0x40000000) ) ? ( rs1 - rs2 ) : ( rs1 + rs2 ); break; 
+						case 1: rval = rs1 << (rs2 & 0x1F); break;
+						case 2: rval = (int32_t)rs1 < (int32_t)rs2; break;
+						case 3: rval = rs1 < rs2; break;
+						case 4: rval = rs1 ^ rs2; break;
+						case 5: rval = (ir & 0x40000000 ) ? ( ((int32_t)rs1) >> (rs2 & 0x1F) ) : ( rs1 >> (rs2 & 0x1F) ); break;
+						case 6: rval = rs1 | rs2; break;
+						case 7: rval = rs1 & rs2; break;
+					}
+					break;
+				}
+				MINIRV32_OPCASE( BITMANIP ): // Zba/Zbb/Zbs, in OP or OP-IMM
+				{
+					uint32_t rs1 = REG( op->rs1 );
+					uint32_t rs2 = ( ir & 0x20 ) ? REG( op->rs2 ) : op->imm;
+					uint32_t sh = rs2 & 0x1F;
+
+					switch( op->fn )
 					{
-						switch( (ir>>12)&7 ) // These could be either op-immediate or op commands.  Be careful.
+						case MINIRV32_ZB_SH1ADD: rval = ( rs1 << 1 ) + rs2; break;
+						case MINIRV32_ZB_SH2ADD: rval = ( rs1 << 2 ) + rs2; break;
+						case MINIRV32_ZB_SH3ADD: rval = ( rs1 << 3 ) + rs2; break;
+						case MINIRV32_ZB_ANDN: rval = rs1 & ~rs2; break;
+						case MINIRV32_ZB_ORN: rval = rs1 | ~rs2; break;
+						case MINIRV32_ZB_XNOR: rval = ~( rs1 ^ rs2 ); break;
+						case MINIRV32_ZB_CLZ: rval = rs1 ? MINIRV32_CLZ( rs1 ) : 32; break;
+						case MINIRV32_ZB_CTZ: rval = rs1 ? MINIRV32_CTZ( rs1 ) : 32; break;
+						case MINIRV32_ZB_CPOP: rval = MINIRV32_CPOP( rs1 ); break;
+						case MINIRV32_ZB_MAX: rval = ( (int32_t)rs1 > (int32_t)rs2 ) ? rs1 : rs2; break;
+						case MINIRV32_ZB_MAXU: rval = ( rs1 > rs2 ) ? rs1 : rs2; break;
+						case MINIRV32_ZB_MIN: rval = ( (int32_t)rs1 < (int32_t)rs2 ) ? rs1 : rs2; break;
+						case MINIRV32_ZB_MINU: rval = ( rs1 < rs2 ) ? rs1 : rs2; break;
+						case MINIRV32_ZB_SEXTB: rval = (int32_t)(int8_t)rs1; break;
+						case MINIRV32_ZB_SEXTH: rval = (int32_t)(int16_t)rs1; break;
+						case MINIRV32_ZB_ZEXTH: rval = rs1 & 0xffff; break;
+						case MINIRV32_ZB_ROL: rval = ( rs1 << sh ) | ( rs1 >> ( ( 32 - sh ) & 0x1F ) ); break;
+						case MINIRV32_ZB_ROR: rval = ( rs1 >> sh ) | ( rs1 << ( ( 32 - sh ) & 0x1F ) ); break;
+						case MINIRV32_ZB_ORCB: // Bytes with any bit set become 0xff.
 						{
-							case 0: rval = (is_reg && (ir & 0x40000000) ) ? ( rs1 - rs2 ) : ( rs1 + rs2 ); break; 
-							case 1: rval = rs1 << (rs2 & 0x1F); break;
-							case 2: rval = (int32_t)rs1 < (int32_t)rs2; break;
-							case 3: rval = rs1 < rs2; break;
-							case 4: rval = rs1 ^ rs2; break;
-							case 5: rval = (ir & 0x40000000 ) ? ( ((int32_t)rs1) >> (rs2 & 0x1F) ) : ( rs1 >> (rs2 & 0x1F) ); break;
-							case 6: rval = rs1 | rs2; break;
-							case 7: rval = rs1 & rs2; break;
+							uint32_t nz = ( ( ( rs1 & 0x7f7f7f7f ) + 0x7f7f7f7f ) | rs1 ) & 0x80808080;
+							rval = ( nz >> 7 ) * 0xff;
+							break;
 						}
+						case MINIRV32_ZB_REV8: rval = ( rs1 >> 24 ) | ( ( rs1 >> 8 ) & 0xff00 ) | ( ( rs1 << 8 ) & 0xff0000 ) | ( rs1 << 24 ); break;
+						case MINIRV32_ZB_BCLR: rval = rs1 & ~( 1u << sh ); break;
+						case MINIRV32_ZB_BEXT: rval = ( rs1 >> sh ) & 1; break;
+						case MINIRV32_ZB_BINV: rval = rs1 ^ ( 1u << sh ); break;
+						case MINIRV32_ZB_BSET: rval = rs1 | ( 1u << sh ); break;
 					}
 					break;
 				}
-				case 0x0f: // 0b0001111
-					rdid = 0;   // fencetype = (ir >> 12) & 0b111; We ignore fences in this impl.
-					break;
-				case 0x73: // Zifencei+Zicsr  (0b1110011)
+				MINIRV32_OPCASE( FENCE ): // 0b0001111
+					break;  // fencetype = (ir >> 12) & 0b111; We ignore fences in this impl.
+				MINIRV32_OPCASE( SYSTEM ): // Zifencei+Zicsr  (0b1110011)
 				{
-					uint32_t csrno = ir >> 20;
+					uint32_t csrno = op->imm;
 					uint32_t microop = ( ir >> 12 ) & 0x7;
 					if( (microop & 3) ) // It's a Zicsr function.
 					{
-						int rs1imm = (ir >> 15) & 0x1f;
+						int rs1imm = op->rs1;
 						uint32_t rs1 = REG(rs1imm);
 						uint32_t writeval = rs1;
 
@@ -370,7 +991,11 @@ MINIRV32_STEPPROTO
 						case 0x342: rval = CSR( mcause ); break;
 						case 0x343: rval = CSR( mtval ); break;
 						case 0xf11: rval = 0xff0ff0ff; break; //mvendorid
+#ifdef MINIRV32_RVC
+						case 0x301: rval = 0x40401105; break; //misa (XLEN=32, IMAC+X)
+#else
 						case 0x301: rval = 0x40401101; break; //misa (XLEN=32, IMA+X)
+#endif
 						//case 0x3B0: rval = 0; break; //pmpaddr0
 						//case 0x3a0: rval = 0; break; //pmpcfg0
 						//case 0xf12: rval = 0x00000000; break; //marchid
@@ -448,10 +1073,10 @@ MINIRV32_STEPPROTO
 						trap = (2+1); 				// Note micrrop 0b100 == undefined.
 					break;
 				}
-				case 0x2f: // RV32A (0b00101111)
+				MINIRV32_OPCASE( AMO ): // RV32A (0b00101111)
 				{
-					uint32_t rs1 = REG((ir >> 15) & 0x1f);
-					uint32_t rs2 = REG((ir >> 20) & 0x1f);
+					uint32_t rs1 = REG( op->rs1 );
+					uint32_t rs2 = REG( op->rs2 );
 					uint32_t irmid = ( ir>>27 ) & 0x1f;
 
 					rs1 -= MINIRV32_RAM_IMAGE_OFFSET;
@@ -490,10 +1115,18 @@ MINIRV32_STEPPROTO
 							case 28: rs2 = (rs2>rval)?rs2:rval; break; //AMOMAXU.W (0b11100)
 							default: trap = (2+1); dowrite = 0; break; //Not supported.
 						}
-						if( dowrite ) MINIRV32_STORE4( rs1, rs2 );
+						if( dowrite )
+						{
+							MINIRV32_STORE4( rs1, rs2 );
+#ifdef MINIRV32_PREDECODE
+							MiniRV32IMAPredecodeInvalidate( rs1, 4 );
+#endif
+							MINIRV32_CODE_WRITTEN( rs1, 4 );
+						}
 					}
 					break;
 				}
+				MINIRV32_OPCASE( ILLEGAL ):
 				default: trap = (2+1); // Fault: Invalid opcode.
 			}
 
@@ -505,11 +1138,31 @@ MINIRV32_STEPPROTO
 			{
 				REGSET( rdid, rval ); // Write back register.
 			}
+
+#ifdef MINIRV32_BLOCK_ENGINE
+			// Keep going while the next op is already decoded; decoded ops
+			// passed the PC checks when they were filled in.  An MMIO store
+			// that ends the slice (count = 0) also ends the block.
+			if( op->opc < MINIRV32_OP_JAL && count )
+			{
+				struct MiniRV32IMAOp * next = MiniRV32IMAPredecodeSlot( ofs_pc + ilen );
+				if( next->pc == pc + ilen )
+				{
+					pc += ilen;
+					ofs_pc += ilen;
+					op = next;
+					rval = 0;
+					cycle++;
+					icount++;
+					goto block_next;
+				}
+			}
+#endif
 		}
 
 		MINIRV32_POSTEXEC( pc, ir, trap );
 
-		pc += 4;
+		pc += ilen;
 	}
 
 	// Handle traps and interrupts.
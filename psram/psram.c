@@ -2,83 +2,436 @@
 #include "hal_psram.h"
 #include "hal_timing.h"
 
+#include "vm_config.h"
+
 #define PSRAM_CMD_RES_EN 0x66
 #define PSRAM_CMD_RESET 0x99
 #define PSRAM_CMD_READ_ID 0x9F
 #define PSRAM_CMD_READ 0x03
 #define PSRAM_CMD_READ_FAST 0x0B
 #define PSRAM_CMD_WRITE 0x02
+#define PSRAM_CMD_READ_QUAD 0xEB
+#define PSRAM_CMD_WRITE_QUAD 0x38
+#define PSRAM_CMD_ENTER_QPI 0x35
+#define PSRAM_CMD_EXIT_QPI 0xF5
 #define PSRAM_KGD 0x5D
 
-void psram_cmd(uint8_t cmd)
+// With PSRAM_QPI set, the chips are switched to QPI mode after reset and
+// every access (command, address and data) goes over 4 lines with
+// psram_qspi_write()/psram_qspi_read().
+#ifndef PSRAM_QPI
+#define PSRAM_QPI 0
+#endif
+
+// With PSRAM_ASYNC set, the HAL can start a write and report when it is
+// done (e.g. by DMA), so psram_write_posted() returns while the data is
+// still going out.
+#ifndef PSRAM_ASYNC
+#define PSRAM_ASYNC 0
+#endif
+
+#if PSRAM_QPI
+#define psram_bus_write psram_qspi_write
+#define psram_bus_write_start psram_qspi_write_start
+#define psram_bus_read psram_qspi_read
+#define PSRAM_CMD_ACCESS_READ PSRAM_CMD_READ_QUAD
+#define PSRAM_CMD_ACCESS_WRITE PSRAM_CMD_WRITE_QUAD
+#define PSRAM_READ_WAIT_BYTES 3 // 6 wait cycles
+#else
+#define psram_bus_write psram_spi_write
+#define psram_bus_write_start psram_spi_write_start
+#define psram_bus_read psram_spi_read
+#define PSRAM_CMD_ACCESS_READ PSRAM_CMD_READ_FAST
+#define PSRAM_CMD_ACCESS_WRITE PSRAM_CMD_WRITE
+#define PSRAM_READ_WAIT_BYTES 1
+#endif
+
+// Size of one PSRAM chip. Guest RAM larger than that is spread over
+// consecutive chips, picked with psram_select_chip().
+#ifndef PSRAM_CHIP_MB
+#define PSRAM_CHIP_MB 8
+#endif
+
+#define PSRAM_CHIP_SIZE ((uint32_t)PSRAM_CHIP_MB * 1024 * 1024)
+
+#ifndef PSRAM_CHIPS
+#define PSRAM_CHIPS ((EMULATOR_RAM_MB + PSRAM_CHIP_MB - 1) / PSRAM_CHIP_MB)
+#endif
+
+#if PSRAM_CHIPS * PSRAM_CHIP_MB < EMULATOR_RAM_MB
+#error PSRAM_CHIPS chips of PSRAM_CHIP_MB are too small for EMULATOR_RAM_MB
+#endif
+
+// With PSRAM_STRIPE set, RAM is interleaved over the chips in chunks of that
+// many bytes (chunk n lives on chip n % PSRAM_CHIPS) instead of filling one
+// chip after the other. Each chip then needs a bus of its own, driven with
+// psram_chip_*(), and a transfer spanning several chunks runs on all of
+// those chips at once.
+#ifndef PSRAM_STRIPE
+#define PSRAM_STRIPE 0
+#endif
+
+// A burst that runs past the end of a page wraps around to its start,
+// unless the chip (at the clock used) supports linear bursts across pages.
+// PSRAM_MAX_BURST, if set, caps the bytes moved per command to keep CE#
+// low no longer than the chip allows (tCEM) at the HAL's clock.
+#ifndef PSRAM_PAGE_SIZE
+#define PSRAM_PAGE_SIZE 1024
+#endif
+
+#ifndef PSRAM_LINEAR_BURST
+#define PSRAM_LINEAR_BURST 0
+#endif
+
+#ifndef PSRAM_MAX_BURST
+#define PSRAM_MAX_BURST 0
+#endif
+
+#if PSRAM_STRIPE && !PSRAM_LINEAR_BURST && PSRAM_PAGE_SIZE % PSRAM_STRIPE
+#error PSRAM_STRIPE must divide PSRAM_PAGE_SIZE
+#endif
+
+// Chips larger than 16 MB take a 4-byte address.
+#ifndef PSRAM_ADDR_BYTES
+#if PSRAM_CHIP_MB > 16
+#define PSRAM_ADDR_BYTES 4
+#else
+#define PSRAM_ADDR_BYTES 3
+#endif
+#endif
+
+static inline void psram_select_n(uint8_t chip)
 {
+#if PSRAM_CHIPS > 1
+    psram_select_chip(chip);
+#else
+    (void)chip;
     psram_select();
-    psram_spi_write(&cmd, 1);
+#endif
+}
+
+#if PSRAM_ASYNC
+static bool psram_posted; // a posted write is still running, its chip selected
+#if PSRAM_STRIPE
+static uint8_t psram_posted_chip; // on that chip's own bus
+static uint8_t psram_posted_cmd[8];
+#endif
+
+void psram_wait(void)
+{
+    if (!psram_posted)
+        return;
+#if PSRAM_STRIPE
+    while (!psram_chip_done(psram_posted_chip))
+        ;
+    psram_chip_deselect(psram_posted_chip);
+#else
+    while (!psram_spi_done())
+        ;
     psram_deselect();
+#endif
+    psram_posted = false;
+}
+#else
+void psram_wait(void)
+{
+}
+#endif
+
+void psram_cmd(uint8_t cmd)
+{
+    psram_wait();
+    for (uint8_t chip = 0; chip < PSRAM_CHIPS; chip++)
+    {
+        psram_select_n(chip);
+        psram_spi_write(&cmd, 1);
+        psram_deselect();
+    }
 }
 
 uint8_t psram_read_kgd(void)
 {
-    uint8_t buf[6] = {0};
-    buf[0] = PSRAM_CMD_READ_ID;
-    psram_select();
-    psram_spi_write(buf, 4);
-    psram_spi_read(buf, 6);
-    for(int i=0; i<6; i++)
-        printf("%x ", buf[i]);
-    printf("\n");
-    psram_deselect();
+    uint8_t ok = 1;
 
-    if (buf[1] == PSRAM_KGD)
-        return 1;
-    return 0;
+    for (uint8_t chip = 0; chip < PSRAM_CHIPS; chip++)
+    {
+        uint8_t buf[6] = {0};
+        buf[0] = PSRAM_CMD_READ_ID;
+        psram_select_n(chip);
+        psram_spi_write(buf, 4);
+        psram_spi_read(buf, 6);
+        for(int i=0; i<6; i++)
+            printf("%x ", buf[i]);
+        printf("\n");
+        psram_deselect();
+
+        if (buf[1] != PSRAM_KGD)
+            ok = 0;
+    }
+    return ok;
 }
 
 uint8_t psram_init(void)
 {
+    psram_wait();
+#if PSRAM_QPI
+    // the chips may still be in QPI mode if only the MCU was reset
+    for (uint8_t chip = 0; chip < PSRAM_CHIPS; chip++)
+    {
+        uint8_t cmd = PSRAM_CMD_EXIT_QPI;
+        psram_select_n(chip);
+        psram_qspi_write(&cmd, 1);
+        psram_deselect();
+    }
+#endif
     psram_cmd(PSRAM_CMD_RES_EN);
     psram_cmd(PSRAM_CMD_RESET);
     timing_delay_ms(10);
-    return psram_read_kgd();
+    uint8_t ok = psram_read_kgd();
+#if PSRAM_QPI
+    psram_cmd(PSRAM_CMD_ENTER_QPI);
+#endif
+    return ok;
+}
+
+// Fill in the command, address and wait bytes of an access, returning how
+// many there are.
+static inline unsigned int psram_command_bytes(uint8_t *cmdAddr, uint32_t chip_addr, bool write)
+{
+    unsigned int cmdSize = 0;
+
+    cmdAddr[cmdSize++] = write ? PSRAM_CMD_ACCESS_WRITE : PSRAM_CMD_ACCESS_READ;
+#if PSRAM_ADDR_BYTES > 3
+    cmdAddr[cmdSize++] = chip_addr >> 24;
+#endif
+    cmdAddr[cmdSize++] = chip_addr >> 16;
+    cmdAddr[cmdSize++] = chip_addr >> 8;
+    cmdAddr[cmdSize++] = chip_addr;
+    if (!write)
+        cmdSize += PSRAM_READ_WAIT_BYTES; // dummy bytes
+    return cmdSize;
+}
+
+static inline void psram_command(uint8_t chip, uint32_t chip_addr, bool write)
+{
+    uint8_t cmdAddr[8];
+    unsigned int cmdSize = psram_command_bytes(cmdAddr, chip_addr, write);
+
+    psram_select_n(chip);
+    psram_bus_write(cmdAddr, cmdSize);
+}
+
+// The chip holding addr, the address within it, and how many bytes from
+// there on are consecutive in that chip.
+static inline uint8_t psram_locate(uint32_t addr, uint32_t *chip_addr, uint32_t *len)
+{
+#if PSRAM_STRIPE
+    uint32_t stripe = addr / PSRAM_STRIPE;
+    *chip_addr = (stripe / PSRAM_CHIPS) * PSRAM_STRIPE + addr % PSRAM_STRIPE;
+    *len = PSRAM_STRIPE - addr % PSRAM_STRIPE;
+    return stripe % PSRAM_CHIPS;
+#else
+    *chip_addr = addr % PSRAM_CHIP_SIZE;
+    *len = PSRAM_CHIP_SIZE - *chip_addr;
+    return addr / PSRAM_CHIP_SIZE;
+#endif
+}
+
+// How many more bytes a burst that is already burst bytes long may move
+// from chip_addr on.
+static inline uint32_t psram_burst_room(uint32_t chip_addr, uint32_t burst)
+{
+    uint32_t room = UINT32_MAX;
+#if !PSRAM_LINEAR_BURST
+    room = PSRAM_PAGE_SIZE - chip_addr % PSRAM_PAGE_SIZE;
+    if (burst && chip_addr % PSRAM_PAGE_SIZE == 0)
+        room = 0;
+#endif
+#if PSRAM_MAX_BURST
+    if (room > PSRAM_MAX_BURST - burst)
+        room = PSRAM_MAX_BURST - burst;
+#endif
+#if PSRAM_LINEAR_BURST
+    (void)chip_addr;
+#if !PSRAM_MAX_BURST
+    (void)burst;
+#endif
+#endif
+    return room;
+}
+
+// Start writing buf and return without waiting for it to finish, if the HAL
+// supports it. buf must be left alone until psram_wait(), which every other
+// PSRAM access calls first.
+void psram_write_posted(uint32_t addr, unsigned int size, void *bufP)
+{
+#if PSRAM_ASYNC
+    uint32_t chip_addr, len;
+    uint8_t chip = psram_locate(addr, &chip_addr, &len);
+
+    if (size <= len && size <= psram_burst_room(chip_addr, 0))
+    {
+        psram_wait();
+#if PSRAM_STRIPE
+        psram_chip_select(chip);
+        psram_chip_write_start(chip, psram_posted_cmd, psram_command_bytes(psram_posted_cmd, chip_addr, true));
+        while (!psram_chip_done(chip))
+            ;
+        psram_chip_write_start(chip, bufP, size);
+        psram_posted_chip = chip;
+#else
+        psram_command(chip, chip_addr, true);
+        psram_bus_write_start(bufP, size);
+#endif
+        psram_posted = true;
+        return;
+    }
+#endif
+    psram_access(addr, size, true, bufP);
 }
 
+#if PSRAM_STRIPE
+// Where one chip is in a striped transfer.
+struct psram_stripe
+{
+    uint32_t from;  // next byte to move, end once the chip is through
+    uint32_t burst; // bytes moved in the open burst
+    bool open;      // selected and the command sent
+    uint8_t cmd[8];
+};
+
+// The chunks of a transfer that land on the same chip are consecutive in
+// that chip, so each chip gets one burst for its chunks (split only where
+// psram_burst_room() says so). Every chip that has nothing running is
+// handed its next step, one chunk per HAL transfer as the chunks are not
+// consecutive in buf, until all of them are through.
 void psram_access(uint32_t addr, unsigned int size, bool write, void *bufP)
 {
-    uint8_t cmdAddr[5];
-    unsigned int cmdSize = 4;
+    uint8_t *buf = bufP;
+    uint32_t end = addr + size;
+    uint32_t first = addr / PSRAM_STRIPE;
+    struct psram_stripe chips[PSRAM_CHIPS];
+    bool busy;
+
+    psram_wait();
 
-    if (write)
-        cmdAddr[0] = PSRAM_CMD_WRITE;
-    else
+    for (uint8_t chip = 0; chip < PSRAM_CHIPS; chip++)
     {
-        cmdAddr[0] = PSRAM_CMD_READ_FAST;
-        cmdSize++;
+        uint32_t s = first + (chip + PSRAM_CHIPS - first % PSRAM_CHIPS) % PSRAM_CHIPS;
+        chips[chip].from = s == first ? addr : s * PSRAM_STRIPE;
+        chips[chip].burst = 0;
+        chips[chip].open = false;
     }
 
-    cmdAddr[1] = addr >> 16;
-    cmdAddr[2] = addr >> 8;
-    cmdAddr[3] = addr;
+    do
+    {
+        busy = false;
+        for (uint8_t chip = 0; chip < PSRAM_CHIPS; chip++)
+        {
+            struct psram_stripe *c = &chips[chip];
 
-    psram_select();
-    psram_spi_write(cmdAddr, cmdSize);
+            if (!psram_chip_done(chip))
+            {
+                busy = true;
+                continue;
+            }
 
-    if (write)
-        psram_spi_write(bufP, size);
-    else
-        psram_spi_read(bufP, size);
-    psram_deselect();
+            uint32_t chip_addr = (c->from / PSRAM_STRIPE / PSRAM_CHIPS) * PSRAM_STRIPE + c->from % PSRAM_STRIPE;
+            uint32_t room = c->from < end ? psram_burst_room(chip_addr, c->burst) : 0;
+            if (c->open && !room)
+            {
+                psram_chip_deselect(chip);
+                c->open = false;
+                c->burst = 0;
+            }
+            if (c->from >= end)
+                continue;
+
+            busy = true;
+            if (!c->open)
+            {
+                psram_chip_select(chip);
+                psram_chip_write_start(chip, c->cmd, psram_command_bytes(c->cmd, chip_addr, write));
+                c->open = true;
+                continue;
+            }
+
+            uint32_t len = PSRAM_STRIPE - c->from % PSRAM_STRIPE;
+            if (len > end - c->from)
+                len = end - c->from;
+            if (len > room)
+                len = room;
+
+            if (write)
+                psram_chip_write_start(chip, buf + (c->from - addr), len);
+            else
+                psram_chip_read_start(chip, buf + (c->from - addr), len);
+
+            c->from += len;
+            c->burst += len;
+            if (c->from % PSRAM_STRIPE == 0)
+                c->from += (PSRAM_CHIPS - 1) * PSRAM_STRIPE; // this chip's next chunk
+        }
+    } while (busy);
 }
+#else
+// Move len bytes at chip_addr, carrying on with the open burst (*burst bytes
+// so far, which must end at chip_addr) for as long as it may, and starting
+// a new one whenever it hits a page boundary or PSRAM_MAX_BURST.
+static void psram_burst(uint8_t chip, uint32_t chip_addr, uint8_t *buf, uint32_t len, bool write, uint32_t *burst)
+{
+    while (len)
+    {
+        uint32_t room = psram_burst_room(chip_addr, *burst);
+        if (!room)
+        {
+            psram_deselect();
+            *burst = 0;
+            room = psram_burst_room(chip_addr, 0);
+        }
+        if (!*burst)
+            psram_command(chip, chip_addr, write);
+        if (room > len)
+            room = len;
 
-void psram_load_data(void *buf, uint32_t addr, unsigned int size)
+        if (write)
+            psram_bus_write(buf, room);
+        else
+            psram_bus_read(buf, room);
+
+        chip_addr += room;
+        buf += room;
+        len -= room;
+        *burst += room;
+    }
+}
+
+void psram_access(uint32_t addr, unsigned int size, bool write, void *bufP)
 {
-    while (size >= 1024)
+    uint8_t *buf = bufP;
+
+    psram_wait();
+    while (size)
     {
-        psram_access(addr, 1024, true, buf);
-        addr += 1024;
-        buf += 1024;
-        size -= 1024;
+        // split transfers at chip boundaries
+        uint32_t chip_addr, len, burst = 0;
+        uint8_t chip = psram_locate(addr, &chip_addr, &len);
+        if (len > size)
+            len = size;
+
+        psram_burst(chip, chip_addr, buf, len, write, &burst);
+        psram_deselect();
+
+        addr += len;
+        buf += len;
+        size -= len;
     }
+}
+#endif
 
-    if (size)
-        psram_access(addr, size, true, buf);
+// psram_access() already splits at page boundaries, so this is one
+// transfer of maximal bursts.
+void psram_load_data(void *buf, uint32_t addr, unsigned int size)
+{
+    psram_access(addr, size, true, buf);
 }
@@ -8,6 +8,8 @@ void psram_cmd(uint8_t cmd);
 uint8_t psram_read_kgd(void);
 uint8_t psram_init(void);
 void psram_access(uint32_t addr, unsigned int size, bool write, void *bufP);
+void psram_write_posted(uint32_t addr, unsigned int size, void *bufP);
+void psram_wait(void);
 void psram_load_data(void *buf, uint32_t addr, unsigned int size);
 
 #endif
\ No newline at end of file
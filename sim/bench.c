@@ -0,0 +1,254 @@
+// Host benchmark: boots the guest against the PSRAM model in psram_sim.c
+// and reports what the memory traffic would have cost on the SPI bus.
+//
+//   bench [-d dir] [-f MHz] [-c ns] [-n Mcycles] [-i text] [-w Mcycles] [-q]
+//
+// IMAGE, DTB and ROOTFS are read from dir (the guest writes to ROOTFS like
+// it would on the SD card). The run ends when the guest powers off, or once
+// it has run -n million cycles; that limit is checked whenever the guest
+// polls the console. -i types text (and a newline) into the console once
+// the guest has printed a shell prompt ("# " or "$ "), or with -w once it
+// has run that many million cycles, so early boot does not swallow it.
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../emulator/emulator.h"
+#define MINIRV32_STEPPROTO // only the state struct is needed here
+#include "../emulator/mini-rv32ima.h"
+#include "../cache/cache.h"
+#include "../pff/pff.h"
+
+#include "hal_console.h"
+#include "hal_psram.h"
+#include "hal_timing.h"
+
+#include "vm_config.h"
+
+extern struct MiniRV32IMAState core;
+
+static uint32_t clock_mhz = 40;
+static uint32_t cs_ns = 100;
+static uint64_t cycle_limit;
+static const char *input = "";
+static uint64_t input_after; // cycles before input is typed, 0 to wait for a prompt
+static bool input_ready;
+static char last_out[2];
+static bool quiet;
+
+static uint64_t host_start;
+static uint64_t skipped_us; // delays are counted, not slept
+
+static uint64_t host_micros(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t guest_cycles(void)
+{
+    return ((uint64_t)core.cycleh << 32) | core.cyclel;
+}
+
+#if CACHE_STATS
+static const char *const stat_names[CACHE_STAT_SET_CONFLICTS] = {
+    "ihits", "imisses", "dhits", "dmisses", "dirty evictions",
+    "psram read", "psram write", "prefetch useful", "prefetch wasted", "victim hits",
+};
+#endif
+
+static void report(const char *why)
+{
+    struct psram_sim_stats s;
+    uint64_t cycles = guest_cycles();
+    double psram_ms;
+
+    cache_flush();
+    psram_sim_get_stats(&s);
+    psram_ms = s.time_ns / 1e6;
+
+    fprintf(stderr, "\n%s after %llu guest cycles, %.2f s on the host\n", why,
+            (unsigned long long)cycles, (host_micros() - host_start) / 1e6);
+    fprintf(stderr, "psram: %llu selects, %llu command bytes, %llu bytes read, %llu written\n",
+            (unsigned long long)s.selects, (unsigned long long)s.cmd_bytes,
+            (unsigned long long)s.read_bytes, (unsigned long long)s.write_bytes);
+    fprintf(stderr, "psram: %llu clocks (%llu in posted writes, %llu overlapped), %.3f ms at %u MHz",
+            (unsigned long long)s.clocks, (unsigned long long)s.posted_clocks,
+            (unsigned long long)s.overlapped_clocks, psram_ms, clock_mhz);
+    if (cycles)
+        fprintf(stderr, ", %.2f ns per guest cycle", (double)s.time_ns / cycles);
+    fprintf(stderr, "\n");
+#if CACHE_STATS
+    for (int i = 0; i < CACHE_STAT_SET_CONFLICTS; i++)
+        fprintf(stderr, "cache: %-16s %llu\n", stat_names[i], (unsigned long long)cache_stat(i));
+#endif
+}
+
+// Console HAL
+
+void console_putc(char c)
+{
+    last_out[0] = last_out[1];
+    last_out[1] = c;
+    if (!quiet)
+        putchar(c);
+}
+
+void console_puts(char *s)
+{
+    while (*s)
+        console_putc(*s++);
+}
+
+bool console_available(void)
+{
+    if (cycle_limit && guest_cycles() >= cycle_limit)
+    {
+        report("Stopped");
+        exit(0);
+    }
+    if (!input_ready)
+    {
+        if (input_after)
+            input_ready = guest_cycles() >= input_after;
+        else
+            input_ready = (last_out[0] == '#' || last_out[0] == '$') && last_out[1] == ' ';
+    }
+    return input_ready && *input;
+}
+
+char console_read(void)
+{
+    return console_available() ? *input++ : 0;
+}
+
+bool pwr_button(void)
+{
+    return true;
+}
+
+void console_panic(char *s)
+{
+    fputs(s, stderr);
+    exit(2);
+}
+
+// Timing HAL
+
+void timing_delay_ms(uint32_t ms)
+{
+    skipped_us += (uint64_t)ms * 1000;
+}
+
+void timing_delay_us(uint32_t us)
+{
+    skipped_us += us;
+}
+
+uint64_t timing_micros(void)
+{
+    return host_micros() + skipped_us;
+}
+
+// Petit FatFs on top of host files
+
+static FILE *file;
+
+FRESULT pf_mount(FATFS *fs)
+{
+    (void)fs;
+    return FR_OK;
+}
+
+FRESULT pf_open(const char *path)
+{
+    if (file)
+        fclose(file);
+    file = fopen(path, "r+b");
+    // files the emulator writes may not exist yet
+    if (!file && (!strcmp(path, "STAT") || !strcmp(path, SNAPSHOT_FILENAME)))
+        file = fopen(path, "w+b");
+    return file ? FR_OK : FR_NO_FILE;
+}
+
+FRESULT pf_read(void *buff, UINT btr, UINT *br)
+{
+    *br = fread(buff, 1, btr, file);
+    return ferror(file) ? FR_DISK_ERR : FR_OK;
+}
+
+FRESULT pf_write(const void *buff, UINT btw, UINT *bw)
+{
+    // pf_write(0, 0, ...) finalizes the write
+    if (!buff)
+    {
+        *bw = 0;
+        return fflush(file) ? FR_DISK_ERR : FR_OK;
+    }
+    *bw = fwrite(buff, 1, btw, file);
+    return *bw == btw ? FR_OK : FR_DISK_ERR;
+}
+
+FRESULT pf_lseek(DWORD ofs)
+{
+    return fseek(file, ofs, SEEK_SET) ? FR_DISK_ERR : FR_OK;
+}
+
+int main(int argc, char **argv)
+{
+    static char line[256];
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:f:c:n:i:w:q")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            if (chdir(optarg))
+            {
+                perror(optarg);
+                return 1;
+            }
+            break;
+        case 'f':
+            clock_mhz = atoi(optarg);
+            break;
+        case 'c':
+            cs_ns = atoi(optarg);
+            break;
+        case 'n':
+            cycle_limit = strtoull(optarg, NULL, 0) * 1000000;
+            break;
+        case 'i':
+            snprintf(line, sizeof(line), "%s\n", optarg);
+            input = line;
+            break;
+        case 'w':
+            input_after = strtoull(optarg, NULL, 0) * 1000000;
+            break;
+        case 'q':
+            quiet = true;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-d dir] [-f MHz] [-c ns] [-n Mcycles] [-i text] [-w Mcycles] [-q]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (!clock_mhz)
+    {
+        fprintf(stderr, "-f must not be 0\n");
+        return 1;
+    }
+
+    psram_sim_config(clock_mhz * 1000000, cs_ns);
+    host_start = host_micros();
+
+    vm_init_hw();
+    int ret = start_vm(EMU_REBOOT);
+
+    report(ret == EMU_POWEROFF ? "Powered off" : ret == EMU_REBOOT ? "Rebooted" : ret == EMU_HIBERNATE ? "Hibernated" : "Stopped");
+    return 0;
+}
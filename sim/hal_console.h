@@ -0,0 +1,14 @@
+#ifndef _HAL_CONSOLE_H
+#define _HAL_CONSOLE_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+void console_putc(char c);
+void console_puts(char *s);
+bool console_available(void);
+char console_read(void);
+bool pwr_button(void);
+void console_panic(char *s);
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef _HAL_PSRAM_H
+#define _HAL_PSRAM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "psram_sim.h"
+
+void psram_select(void);
+void psram_deselect(void);
+void psram_spi_write(uint8_t *buf, size_t sz);
+void psram_spi_read(uint8_t *buf, size_t sz);
+void psram_select_chip(uint8_t chip);
+void psram_qspi_write(uint8_t *buf, size_t sz);
+void psram_qspi_read(uint8_t *buf, size_t sz);
+void psram_spi_write_start(uint8_t *buf, size_t sz);
+void psram_qspi_write_start(uint8_t *buf, size_t sz);
+bool psram_spi_done(void);
+void psram_chip_select(uint8_t chip);
+void psram_chip_deselect(uint8_t chip);
+void psram_chip_write_start(uint8_t chip, uint8_t *buf, size_t sz);
+void psram_chip_read_start(uint8_t chip, uint8_t *buf, size_t sz);
+bool psram_chip_done(uint8_t chip);
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef _HAL_TIMING_H
+#define _HAL_TIMING_H
+
+#include <stdint.h>
+
+void timing_delay_ms(uint32_t ms);
+void timing_delay_us(uint32_t us);
+uint64_t timing_micros(void);
+
+#endif
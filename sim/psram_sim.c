@@ -0,0 +1,424 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "hal_psram.h"
+
+#include "vm_config.h"
+
+// Commands understood by the model, those of an APS6404-style chip.
+#define SIM_CMD_RES_EN 0x66
+#define SIM_CMD_RESET 0x99
+#define SIM_CMD_READ_ID 0x9F
+#define SIM_CMD_READ 0x03
+#define SIM_CMD_READ_FAST 0x0B
+#define SIM_CMD_WRITE 0x02
+#define SIM_CMD_READ_QUAD 0xEB
+#define SIM_CMD_WRITE_QUAD 0x38
+#define SIM_CMD_ENTER_QPI 0x35
+#define SIM_CMD_EXIT_QPI 0xF5
+
+#define SIM_MFID 0x0D
+#define SIM_KGD 0x5D
+
+#ifndef PSRAM_SIM_CLOCK_HZ
+#define PSRAM_SIM_CLOCK_HZ 40000000
+#endif
+
+#ifndef PSRAM_SIM_CS_NS
+#define PSRAM_SIM_CS_NS 100
+#endif
+
+// Bursts wrap within a page of this size, as on the real chip; 0 models a
+// chip that bursts linearly across pages.
+#ifndef PSRAM_SIM_PAGE_SIZE
+#define PSRAM_SIM_PAGE_SIZE 1024
+#endif
+
+#ifndef PSRAM_SIM_MAX_CHIPS
+#define PSRAM_SIM_MAX_CHIPS 8
+#endif
+
+// Same defaults as psram.c.
+#ifndef PSRAM_CHIP_MB
+#define PSRAM_CHIP_MB 8
+#endif
+
+#define SIM_CHIP_SIZE ((uint32_t)PSRAM_CHIP_MB * 1024 * 1024)
+
+#ifndef PSRAM_ADDR_BYTES
+#if PSRAM_CHIP_MB > 16
+#define PSRAM_ADDR_BYTES 4
+#else
+#define PSRAM_ADDR_BYTES 3
+#endif
+#endif
+
+struct SimChip
+{
+    uint8_t *mem; // allocated on first select
+    bool qpi;
+
+    // State of the command on the chip
+    uint8_t cmd;
+    uint32_t received; // bytes since CS# went low
+    uint32_t header;   // command, address and wait bytes of cmd
+    uint32_t addr;
+
+    // Its own bus, used by psram_chip_*()
+    bool chip_selected;
+    uint8_t *chip_buf; // transfer started and not reported done yet
+    size_t chip_sz;
+    bool chip_read;
+    uint64_t free_at; // clock at which the bus is free again
+};
+
+static struct SimChip chips[PSRAM_SIM_MAX_CHIPS];
+static struct SimChip *selected; // on the shared bus, or the chip being moved
+
+// A posted write that has not been reported done yet
+static bool posting;
+static uint8_t *posted_buf;
+static size_t posted_sz;
+static bool posted_quad;
+
+// Chips selected on their own bus, and the striped transfer they are in:
+// the clock it has reached, counted from its start, and the clocks moved
+// on all buses together.
+static uint8_t chips_selected;
+static uint64_t stripe_now;
+static uint64_t stripe_clocks;
+
+static uint32_t clock_hz = PSRAM_SIM_CLOCK_HZ;
+static uint32_t cs_ns = PSRAM_SIM_CS_NS;
+static struct psram_sim_stats stats;
+
+static void sim_fail(const char *msg)
+{
+    fprintf(stderr, "psram_sim: %s\n", msg);
+    abort();
+}
+
+void psram_sim_config(uint32_t hz, uint32_t ns)
+{
+    clock_hz = hz;
+    cs_ns = ns;
+}
+
+void psram_sim_get_stats(struct psram_sim_stats *s)
+{
+    *s = stats;
+    s->time_ns = (stats.clocks - stats.overlapped_clocks) * 1000000000ull / clock_hz + stats.selects * cs_ns;
+}
+
+void psram_sim_clear_stats(void)
+{
+    memset(&stats, 0, sizeof(stats));
+}
+
+// Lower CS# on a chip, starting a new command.
+static struct SimChip *sim_select(uint8_t chip)
+{
+    if (chip >= PSRAM_SIM_MAX_CHIPS)
+        sim_fail("no such chip");
+
+    struct SimChip *c = &chips[chip];
+    if (!c->mem && !(c->mem = calloc(1, SIM_CHIP_SIZE)))
+        sim_fail("out of memory");
+    c->received = 0;
+    stats.selects++;
+    return c;
+}
+
+void psram_select_chip(uint8_t chip)
+{
+    if (posting)
+        sim_fail("chip selected while a posted write is running");
+    if (chips_selected)
+        sim_fail("chip selected while a striped transfer is running");
+    selected = sim_select(chip);
+}
+
+void psram_select(void)
+{
+    psram_select_chip(0);
+}
+
+void psram_deselect(void)
+{
+    if (posting)
+        sim_fail("chip deselected while a posted write is running");
+    selected = NULL;
+}
+
+// Bytes the chip takes after the command byte before data: the address and
+// the wait cycles, which depend on the bus mode.
+static uint32_t sim_header(uint8_t c, bool qpi)
+{
+    switch (c)
+    {
+    case SIM_CMD_READ_ID:
+        return 1 + 3;
+    case SIM_CMD_READ:
+    case SIM_CMD_WRITE:
+        return 1 + PSRAM_ADDR_BYTES;
+    case SIM_CMD_READ_FAST:
+        return 1 + PSRAM_ADDR_BYTES + (qpi ? 2 : 1); // 4 or 8 wait cycles
+    case SIM_CMD_READ_QUAD:
+        return 1 + PSRAM_ADDR_BYTES + 3; // 6 wait cycles
+    case SIM_CMD_WRITE_QUAD:
+        return 1 + PSRAM_ADDR_BYTES;
+    case SIM_CMD_RES_EN:
+    case SIM_CMD_RESET:
+    case SIM_CMD_ENTER_QPI:
+    case SIM_CMD_EXIT_QPI:
+        return 1;
+    }
+    sim_fail("unknown command");
+    return 0;
+}
+
+static inline uint8_t *sim_next(void)
+{
+    uint8_t *p = &selected->mem[selected->addr];
+#if PSRAM_SIM_PAGE_SIZE
+    selected->addr = (selected->addr & ~(uint32_t)(PSRAM_SIM_PAGE_SIZE - 1)) | ((selected->addr + 1) & (PSRAM_SIM_PAGE_SIZE - 1));
+#else
+    selected->addr = (selected->addr + 1) % SIM_CHIP_SIZE;
+#endif
+    return p;
+}
+
+static void sim_check_bus(bool quad)
+{
+    if (!selected)
+        sim_fail("transfer without a chip selected");
+    if (quad != selected->qpi)
+        sim_fail(quad ? "QPI transfer in SPI mode" : "SPI transfer in QPI mode");
+}
+
+static void sim_write(uint8_t *buf, size_t sz, bool quad)
+{
+    // psram_init() sends EXIT_QPI over 4 lines in case only the MCU was
+    // reset; a chip in SPI mode just sees noise and ignores it.
+    if (quad && selected && !selected->qpi && selected->received == 0 && sz == 1 && buf[0] == SIM_CMD_EXIT_QPI)
+    {
+        stats.clocks += 2;
+        stats.cmd_bytes++;
+        selected->received = 1;
+        selected->cmd = SIM_CMD_EXIT_QPI;
+        selected->header = 1;
+        return;
+    }
+    sim_check_bus(quad);
+    stats.clocks += sz * (quad ? 2 : 8);
+
+    for (size_t i = 0; i < sz; i++)
+    {
+        uint8_t b = buf[i];
+
+        if (selected->received == 0)
+        {
+            selected->cmd = b;
+            selected->header = sim_header(selected->cmd, selected->qpi);
+#if PSRAM_STRIPE
+            // guest RAM only moves over the chips' own buses
+            if (!selected->chip_selected && b != SIM_CMD_READ_ID && sim_header(b, selected->qpi) > 1)
+                sim_fail("data command on the shared bus with PSRAM_STRIPE");
+#endif
+            selected->addr = 0;
+            if (selected->cmd == SIM_CMD_ENTER_QPI)
+                selected->qpi = true;
+            else if (selected->cmd == SIM_CMD_EXIT_QPI || selected->cmd == SIM_CMD_RESET)
+                selected->qpi = false;
+        }
+        else if (selected->received < selected->header)
+        {
+            if (selected->received <= (selected->cmd == SIM_CMD_READ_ID ? 3 : PSRAM_ADDR_BYTES))
+                selected->addr = (selected->addr << 8) | b;
+            if (selected->received + 1 == selected->header)
+                selected->addr %= SIM_CHIP_SIZE;
+        }
+        else if (selected->cmd == SIM_CMD_WRITE || selected->cmd == SIM_CMD_WRITE_QUAD)
+        {
+            *sim_next() = b;
+            stats.write_bytes++;
+            selected->received++;
+            continue;
+        }
+        else
+            sim_fail("data written after a command that takes none");
+
+        stats.cmd_bytes++;
+        selected->received++;
+    }
+}
+
+static void sim_read(uint8_t *buf, size_t sz, bool quad)
+{
+    sim_check_bus(quad);
+    if (selected->received == 0 || selected->received < selected->header)
+        sim_fail("read before the command was complete");
+    stats.clocks += sz * (quad ? 2 : 8);
+
+    for (size_t i = 0; i < sz; i++)
+    {
+        switch (selected->cmd)
+        {
+        case SIM_CMD_READ_ID:
+        {
+            uint32_t n = selected->received - selected->header;
+            buf[i] = n == 0 ? SIM_MFID : n == 1 ? SIM_KGD : 0;
+            break;
+        }
+        case SIM_CMD_READ:
+        case SIM_CMD_READ_FAST:
+        case SIM_CMD_READ_QUAD:
+            buf[i] = *sim_next();
+            stats.read_bytes++;
+            break;
+        default:
+            sim_fail("data read after a command that returns none");
+        }
+        selected->received++;
+    }
+}
+
+void psram_spi_write(uint8_t *buf, size_t sz)
+{
+    sim_write(buf, sz, false);
+}
+
+void psram_spi_read(uint8_t *buf, size_t sz)
+{
+    sim_read(buf, sz, false);
+}
+
+void psram_qspi_write(uint8_t *buf, size_t sz)
+{
+    sim_write(buf, sz, true);
+}
+
+void psram_qspi_read(uint8_t *buf, size_t sz)
+{
+    sim_read(buf, sz, true);
+}
+
+// A posted write only takes its data from buf once psram_spi_done() is
+// called, so reusing buf too early shows up as corrupted guest memory, and
+// touching the bus before then fails outright.
+static void sim_write_start(uint8_t *buf, size_t sz, bool quad)
+{
+    if (posting)
+        sim_fail("write started while a posted write is running");
+    posted_buf = buf;
+    posted_sz = sz;
+    posted_quad = quad;
+    posting = true;
+}
+
+void psram_spi_write_start(uint8_t *buf, size_t sz)
+{
+    sim_write_start(buf, sz, false);
+}
+
+void psram_qspi_write_start(uint8_t *buf, size_t sz)
+{
+    sim_write_start(buf, sz, true);
+}
+
+bool psram_spi_done(void)
+{
+    if (posting)
+    {
+        uint64_t clocks = stats.clocks;
+
+        posting = false;
+        sim_write(posted_buf, posted_sz, posted_quad);
+        stats.posted_clocks += stats.clocks - clocks;
+    }
+    return true;
+}
+
+// Each chip on its own bus: a started transfer takes or fills buf once
+// psram_chip_done() is called, and runs from the clock the striped transfer
+// had reached when it was started, so transfers on different chips overlap.
+static struct SimChip *sim_chip(uint8_t chip)
+{
+    if (chip >= PSRAM_SIM_MAX_CHIPS)
+        sim_fail("no such chip");
+    if (posting || selected)
+        sim_fail("chip bus used while the shared bus is busy");
+    return &chips[chip];
+}
+
+void psram_chip_select(uint8_t chip)
+{
+    struct SimChip *c = sim_chip(chip);
+
+    if (c->chip_selected)
+        sim_fail("chip selected twice");
+    sim_select(chip);
+    c->chip_selected = true;
+    c->free_at = stripe_now;
+    chips_selected++;
+}
+
+void psram_chip_deselect(uint8_t chip)
+{
+    struct SimChip *c = sim_chip(chip);
+
+    if (!c->chip_selected || c->chip_buf)
+        sim_fail("chip deselected while not selected or busy");
+    c->chip_selected = false;
+    if (!--chips_selected)
+    {
+        stats.overlapped_clocks += stripe_clocks - stripe_now;
+        stripe_now = stripe_clocks = 0;
+    }
+}
+
+static void sim_chip_start(uint8_t chip, uint8_t *buf, size_t sz, bool read)
+{
+    struct SimChip *c = sim_chip(chip);
+
+    if (!c->chip_selected || c->chip_buf)
+        sim_fail("transfer started on a chip not selected or busy");
+    c->chip_buf = buf;
+    c->chip_sz = sz;
+    c->chip_read = read;
+    c->free_at = stripe_now;
+}
+
+void psram_chip_write_start(uint8_t chip, uint8_t *buf, size_t sz)
+{
+    sim_chip_start(chip, buf, sz, false);
+}
+
+void psram_chip_read_start(uint8_t chip, uint8_t *buf, size_t sz)
+{
+    sim_chip_start(chip, buf, sz, true);
+}
+
+bool psram_chip_done(uint8_t chip)
+{
+    struct SimChip *c = sim_chip(chip);
+
+    if (c->chip_buf)
+    {
+        uint64_t clocks = stats.clocks;
+
+        selected = c;
+        if (c->chip_read)
+            sim_read(c->chip_buf, c->chip_sz, c->qpi);
+        else
+            sim_write(c->chip_buf, c->chip_sz, c->qpi);
+        selected = NULL;
+        c->chip_buf = NULL;
+
+        c->free_at += stats.clocks - clocks;
+        stripe_clocks += stats.clocks - clocks;
+        if (stripe_now < c->free_at)
+            stripe_now = c->free_at;
+    }
+    return true;
+}
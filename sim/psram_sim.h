@@ -0,0 +1,27 @@
+#ifndef _PSRAM_SIM_H
+#define _PSRAM_SIM_H
+
+#include <stdint.h>
+
+// Host-side model of the PSRAM chips behind hal_psram.h. Memory lives in
+// host buffers and every transfer is costed in SPI clocks: 8 per byte on
+// the 1-line bus, 2 per byte in QPI mode, plus a fixed overhead per CS#
+// toggle. Striped transfers on chips with a bus each overlap in time.
+struct psram_sim_stats
+{
+    uint64_t selects;           // CS# toggles
+    uint64_t cmd_bytes;         // command, address and wait bytes
+    uint64_t read_bytes;        // data bytes read
+    uint64_t write_bytes;       // data bytes written
+    uint64_t clocks;            // SPI clocks for all of the above
+    uint64_t posted_clocks;     // of which spent in posted writes on the shared bus
+    uint64_t overlapped_clocks; // of which run alongside another chip's bus
+    uint64_t time_ns;           // the other clocks at the configured frequency plus CS# overhead
+};
+
+// SPI clock in Hz, and nanoseconds lost per CS# toggle (tCPH, HAL overhead).
+void psram_sim_config(uint32_t clock_hz, uint32_t cs_ns);
+void psram_sim_get_stats(struct psram_sim_stats *stats);
+void psram_sim_clear_stats(void);
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef _VM_CONFIG_H
+#define _VM_CONFIG_H
+
+// Configuration for the host benchmark. Everything can be overridden with
+// -D, e.g. to try another cache geometry.
+
+#define KERNEL_FILENAME "IMAGE"
+#define BLK_FILENAME "ROOTFS"
+#define DTB_FILENAME "DTB"
+#define SNAPSHOT_FILENAME "SNAPSHOT"
+
+#ifndef EMULATOR_RAM_MB
+#define EMULATOR_RAM_MB 8
+#endif
+#define DTB_SIZE 2048
+#define KERNEL_CMDLINE "console=hvc0 root=fe00"
+
+// Guest time follows the instruction count, so runs are reproducible.
+#define EMULATOR_TIME_DIV 1
+#define EMULATOR_FIXED_UPDATE 1
+
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE 16
+#define OFFSET_BITS 4 // log2(CACHE_LINE_SIZE)
+#endif
+#ifndef CACHE_SET_SIZE
+#define CACHE_SET_SIZE 4096
+#define INDEX_BITS 12 // log2(CACHE_SET_SIZE)
+#endif
+
+#ifndef CACHE_STATS
+#define CACHE_STATS 1
+#endif
+
+#endif